@@ -7,17 +7,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "dudect/cpucycles.h"
+#include "perf.h"
 #include "report.h"
 #include "web.h"
 
 /* Some global values */
 int simulation = 0;
 int show_entropy = 0;
+static int show_perf = 0;
+static int cmd_depth = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
 static bool block_flag = false;
@@ -31,6 +36,9 @@ static double first_time, last_time;
 
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ *
+ * Regular files are mapped into memory instead, and their lines are parsed
+ * where they are, without reading them into a buffer first.
  */
 
 #define RIO_BUFSIZE 8192
@@ -40,6 +48,9 @@ typedef struct __rio {
     int count;             /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapped file, or NULL when read */
+    size_t map_len;        /* Size of mapped file */
+    size_t map_pos;        /* Offset of next unread byte in map */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
 
@@ -54,6 +65,10 @@ static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
 
+/* Selection of targets by "cmd@target" */
+static target_enter_func_t target_enter = NULL;
+static target_leave_func_t target_leave = NULL;
+
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
@@ -71,6 +86,7 @@ static bool push_file(char *fname);
 static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
+static bool cmd_done();
 
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
@@ -111,49 +127,45 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     *last_loc = param;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+void set_cmd_target(target_enter_func_t enter, target_leave_func_t leave)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+    target_enter = enter;
+    target_leave = leave;
+}
 
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
+/* Parse the first len characters of a string into a command line. The line
+ * need not be null-terminated, as when it lies in a mapped file.
+ */
+static char **parse_args(const char *line, size_t len, int *argcp)
+{
+    /* Must first determine how many arguments there are */
+    const char *end = line + len;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
+    for (const char *src = line; src < end;) {
+        while (src < end && isspace((unsigned char) *src))
+            src++;
+        if (src == end)
+            break;
+        argc++;
+        while (src < end && !isspace((unsigned char) *src))
+            src++;
     }
 
-    /* Now assemble into array of strings */
+    /* Now copy each word into a string of its own */
     char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
+    const char *src = line;
     for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        while (isspace((unsigned char) *src))
+            src++;
+        const char *word = src;
+        while (src < end && !isspace((unsigned char) *src))
+            src++;
+        size_t wlen = src - word;
+        argv[i] = malloc_or_fail(wlen + 1, "parse_args");
+        memcpy(argv[i], word, wlen);
+        argv[i][wlen] = '\0';
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
     return argv;
 }
@@ -172,13 +184,32 @@ static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
+
+    /* Split off the target of "cmd@target", restored before returning */
+    char *at = target_enter ? strchr(argv[0], '@') : NULL;
+    if (at) {
+        *at = '\0';
+        if (!target_enter(at + 1)) {
+            *at = '@';
+            record_error();
+            return false;
+        }
+    }
+
     /* Try to find matching command */
     cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
     if (next_cmd) {
+        /* Only count the outermost command, e.g. "time sort" as a whole */
+        bool count = cmd_depth++ == 0 && show_perf;
+        if (count)
+            perf_begin();
         ok = next_cmd->operation(argc, argv);
+        if (count && show_perf)
+            perf_end(argv[0]);
+        cmd_depth--;
         if (!ok)
             record_error();
     } else {
@@ -187,25 +218,36 @@ static bool interpret_cmda(int argc, char *argv[])
         ok = false;
     }
 
+    if (at) {
+        target_leave();
+        *at = '@';
+    }
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Execute a command from the first len characters of a command line */
+static bool interpret_line(const char *cmdline, size_t len)
 {
     if (quit_flag)
         return false;
 
     int argc;
-    char **argv = parse_args(cmdline, &argc);
+    char **argv = parse_args(cmdline, len, &argc);
     bool ok = interpret_cmda(argc, argv);
     for (int i = 0; i < argc; i++)
         free_string(argv[i]);
     free_array(argv, argc, sizeof(char *));
+    report_flush();
 
     return ok;
 }
 
+/* Execute a command from a command line */
+static bool interpret_cmd(char *cmdline)
+{
+    return interpret_line(cmdline, strlen(cmdline));
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -221,6 +263,19 @@ void set_echo(bool on)
     echo = on ? 1 : 0;
 }
 
+/* Open or close the counters when option perf changes */
+static void set_perf(int oldval)
+{
+    if (!show_perf) {
+        perf_close();
+        return;
+    }
+    if (!oldval && !perf_open()) {
+        report(1, "Hardware performance counters are not available");
+        show_perf = 0;
+    }
+}
+
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
@@ -242,6 +297,9 @@ static bool do_quit(int argc, char *argv[])
     while (buf_stack)
         pop_file();
 
+    perf_close();
+    show_perf = 0;
+
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
@@ -379,12 +437,15 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        int64_t start = cpucycles_begin();
         ok = interpret_cmda(argc - 1, argv + 1);
+        int64_t cycles = cpucycles_end() - start - cpucycles_overhead();
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            report(1, "Delta time = %.3f (%.0f ns)", delta,
+                   cpucycles_to_ns(cycles > 0 ? cycles : 0));
         }
     }
 
@@ -404,8 +465,10 @@ static bool do_web(int argc, char *argv[])
 
     web_fd = web_open(port);
     if (web_fd > 0) {
+        report_flush();
         printf("listen on port %d, fd is %d\n", port, web_fd);
         line_set_eventmux_callback(web_eventmux);
+        web_set_interpret_func(interpret_cmd, cmd_done);
         use_linenoise = false;
     } else {
         perror("ERROR");
@@ -437,6 +500,8 @@ void init_cmd()
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("perf", &show_perf, "Show/Hide hardware performance counters",
+              set_perf);
 
     init_in();
     init_time(&last_time);
@@ -461,9 +526,23 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
+    rnew->map_pos = 0;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /* Map regular files. Anything else, or a failed mapping, is read. */
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+        }
+    }
+
     return true;
 }
 
@@ -473,6 +552,8 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -484,16 +565,46 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
+/* Take the next line of a mapped file. Its end is only given by the length,
+ * and it stays valid until the file is popped. A last line without newline
+ * is returned as it is, and the file is popped on the call after.
+ */
+static char *readline_mapped(size_t *lenp)
+{
+    char *line = buf_stack->map + buf_stack->map_pos;
+    size_t left = buf_stack->map_len - buf_stack->map_pos;
+
+    if (!left) {
+        /* Encountered EOF */
+        pop_file();
+        return NULL;
+    }
+
+    char *nl = memchr(line, '\n', left);
+    size_t len = nl ? (size_t) (nl - line) + 1 : left;
+    buf_stack->map_pos += len;
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%.*s%s", (int) len, line, nl ? "" : "\n");
+    }
+
+    *lenp = len;
+    return line;
+}
+
+/* Read command from input file, and set *lenp to its length.
  * When hit EOF, close that file and return NULL
  */
-static char *readline()
+static char *readline(size_t *lenp)
 {
     char c;
     char *lptr = linebuf;
 
     if (!buf_stack)
         return NULL;
+    if (buf_stack->map)
+        return readline_mapped(lenp);
 
     for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->count <= 0) {
@@ -512,6 +623,7 @@ static char *readline()
                         report_noreturn(1, prompt);
                         report_noreturn(1, linebuf);
                     }
+                    *lenp = lptr - linebuf - 1;
                     return linebuf;
                 }
                 return NULL;
@@ -537,6 +649,7 @@ static char *readline()
         report_noreturn(1, linebuf);
     }
 
+    *lenp = lptr - linebuf - 1;
     return linebuf;
 }
 
@@ -554,7 +667,6 @@ static bool cmd_done()
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -584,13 +696,14 @@ static int cmd_select(int nfds,
         if (infd == STDIN_FILENO && prompt_flag) {
             char *cmdline = linenoise(prompt);
             if (cmdline)
-                interpret_cmd(cmdline);
+                web_finish(interpret_cmd(cmdline));
             fflush(stdout);
             prompt_flag = true;
         } else if (infd != STDIN_FILENO) {
-            char *cmdline = readline();
+            size_t len;
+            char *cmdline = readline(&len);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_line(cmdline, len);
         }
     }
     return 0;
@@ -657,8 +770,7 @@ bool run_console(char *infile_name)
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
             interpret_cmd(cmdline);
-            line_history_add(cmdline);       /* Add to the history. */
-            line_history_save(HISTORY_FILE); /* Save the history on disk. */
+            line_history_add(cmdline); /* Add to the history and journal */
             line_free(cmdline);
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
                 cmd_select(0, NULL, NULL, NULL, NULL);
@@ -50,6 +50,14 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
+/* Commands written as "cmd@target" run with target selected, e.g. a queue.
+ * enter() selects it, returning false when there is no such target, and
+ * leave() undoes that once the command is done.
+ */
+typedef bool (*target_enter_func_t)(const char *target);
+typedef void (*target_leave_func_t)(void);
+void set_cmd_target(target_enter_func_t enter, target_leave_func_t leave);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
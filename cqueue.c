@@ -0,0 +1,497 @@
+/* Queue of strings for concurrent producers and consumers
+ *
+ * Both kinds are the queues of Michael and Scott, "Simple, Fast, and
+ * Practical Non-Blocking and Blocking Concurrent Queue Algorithms" (PODC
+ * 1996): a singly linked list whose first node is a dummy, with a head and
+ * a tail pointer. Removing a string makes the node holding it the new
+ * dummy, so producers and consumers only ever meet when the queue is empty.
+ *
+ * The lock-free queue cannot free a removed node while another thread may
+ * still be reading it. Its operations are epoch sections, and removed nodes
+ * are retired to be freed once no operation can hold them.
+ *
+ * Nodes are numbered in the order they are linked, so the strings in the
+ * queue at any instant are those numbered after the dummy and up to the
+ * last node. Snapshots read both ends at one instant, then copy the nodes
+ * between them at leisure: nodes of either kind of queue, and their
+ * strings, are retired rather than freed, and a snapshot is an epoch
+ * section, so it never waits for or holds up producers and consumers.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cqueue.h"
+#include "epoch.h"
+
+/* Head and tail are written by different threads, so they are kept on cache
+ * lines of their own.
+ */
+#define CACHE_LINE 64
+
+typedef struct cq_node {
+    _Atomic(struct cq_node *) next;
+    char *value;  /* Already taken in the dummy node */
+    uint64_t seq; /* Strings linked up to and including this one */
+} cq_node_t;
+
+struct cqueue {
+    cq_kind_t kind;
+    _Alignas(CACHE_LINE) _Atomic(cq_node_t *) head;
+    pthread_mutex_t head_lock; /* Only for CQ_TWO_LOCK */
+    _Alignas(CACHE_LINE) _Atomic(cq_node_t *) tail;
+    pthread_mutex_t tail_lock; /* Only for CQ_TWO_LOCK */
+};
+
+static cq_node_t *new_node(const char *s)
+{
+    cq_node_t *node = malloc(sizeof(cq_node_t));
+    if (!node)
+        return NULL;
+    node->value = NULL;
+    if (s && !(node->value = strdup(s))) {
+        free(node);
+        return NULL;
+    }
+    node->seq = 0;
+    atomic_init(&node->next, NULL);
+    return node;
+}
+
+/* Release a dummy node, along with the string taken from it */
+static void free_node(void *p)
+{
+    cq_node_t *node = p;
+    free(node->value);
+    free(node);
+}
+
+/* Copy value out to sp, as q_remove_head() does */
+static void copy_value(const char *value, char *sp, size_t bufsize)
+{
+    if (sp && bufsize) {
+        size_t len = strlen(value);
+        if (len > bufsize - 1)
+            len = bufsize - 1;
+        memcpy(sp, value, len);
+        sp[len] = '\0';
+    }
+}
+
+cqueue_t *cq_new(cq_kind_t kind)
+{
+    cqueue_t *q = aligned_alloc(CACHE_LINE, sizeof(cqueue_t));
+    if (!q)
+        return NULL;
+    cq_node_t *dummy = new_node(NULL);
+    if (!dummy) {
+        free(q);
+        return NULL;
+    }
+
+    q->kind = kind;
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    pthread_mutex_init(&q->head_lock, NULL);
+    pthread_mutex_init(&q->tail_lock, NULL);
+    return q;
+}
+
+void cq_free(cqueue_t *q)
+{
+    if (!q)
+        return;
+
+    cq_node_t *node = atomic_load(&q->head);
+    while (node) {
+        cq_node_t *next = atomic_load(&node->next);
+        free_node(node);
+        node = next;
+    }
+    epoch_drain();
+
+    pthread_mutex_destroy(&q->head_lock);
+    pthread_mutex_destroy(&q->tail_lock);
+    free(q);
+}
+
+static void lock_free_insert(cqueue_t *q, cq_node_t *node)
+{
+    epoch_enter();
+    while (1) {
+        cq_node_t *tail = atomic_load(&q->tail);
+        cq_node_t *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&q->tail))
+            continue;
+        if (next) {
+            /* Tail fell behind, help it along */
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        node->seq = tail->seq + 1;
+        if (atomic_compare_exchange_strong(&tail->next, &next, node)) {
+            atomic_compare_exchange_strong(&q->tail, &tail, node);
+            break;
+        }
+    }
+    epoch_exit();
+}
+
+static bool lock_free_remove(cqueue_t *q, char *sp, size_t bufsize)
+{
+    cq_node_t *head, *next;
+    char *value;
+    epoch_enter();
+    while (1) {
+        head = atomic_load(&q->head);
+        cq_node_t *tail = atomic_load(&q->tail);
+        next = atomic_load(&head->next);
+        if (head != atomic_load(&q->head))
+            continue;
+        if (!next) {
+            epoch_exit();
+            return false;
+        }
+        if (head == tail) {
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        value = next->value;
+        if (atomic_compare_exchange_strong(&q->head, &head, next))
+            break;
+    }
+    /* The string goes once next is removed too, so copy it in the section */
+    copy_value(value, sp, bufsize);
+    epoch_exit();
+    epoch_retire(head, free_node);
+    return true;
+}
+
+static void two_lock_insert(cqueue_t *q, cq_node_t *node)
+{
+    pthread_mutex_lock(&q->tail_lock);
+    cq_node_t *tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    node->seq = tail->seq + 1;
+    atomic_store_explicit(&tail->next, node, memory_order_release);
+    /* Released for snapshots, which take no lock */
+    atomic_store_explicit(&q->tail, node, memory_order_release);
+    pthread_mutex_unlock(&q->tail_lock);
+}
+
+static bool two_lock_remove(cqueue_t *q, char *sp, size_t bufsize)
+{
+    pthread_mutex_lock(&q->head_lock);
+    cq_node_t *head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    cq_node_t *next =
+        atomic_load_explicit(&head->next, memory_order_acquire);
+    if (!next) {
+        pthread_mutex_unlock(&q->head_lock);
+        return false;
+    }
+    copy_value(next->value, sp, bufsize);
+    atomic_store_explicit(&q->head, next, memory_order_release);
+    pthread_mutex_unlock(&q->head_lock);
+
+    /* Snapshots may still be reading it */
+    epoch_retire(head, free_node);
+    return true;
+}
+
+bool cq_insert_tail(cqueue_t *q, const char *s)
+{
+    if (!q || !s)
+        return false;
+    cq_node_t *node = new_node(s);
+    if (!node)
+        return false;
+
+    if (q->kind == CQ_LOCK_FREE)
+        lock_free_insert(q, node);
+    else
+        two_lock_insert(q, node);
+    return true;
+}
+
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize)
+{
+    if (!q)
+        return false;
+    return q->kind == CQ_LOCK_FREE ? lock_free_remove(q, sp, bufsize)
+                                   : two_lock_remove(q, sp, bufsize);
+}
+
+bool cq_snapshot(cqueue_t *q, size_t max, cq_snapshot_t *snap)
+{
+    cq_node_t *head, *tail;
+    snap->retries = 0;
+    epoch_enter();
+    while (1) {
+        head = atomic_load(&q->head);
+        tail = atomic_load(&q->tail);
+        cq_node_t *next = atomic_load(&tail->next);
+        if (next) {
+            /* Tail fell behind. Only the lock-free queue lets others help */
+            if (q->kind == CQ_LOCK_FREE)
+                atomic_compare_exchange_strong(&q->tail, &tail, next);
+            else
+                sched_yield();
+        } else if (head == atomic_load(&q->head)) {
+            /* Head did not move while tail was found to be the last node,
+             * so the strings between them were all in the queue then.
+             */
+            break;
+        }
+        snap->retries++;
+    }
+
+    snap->size = tail->seq - head->seq;
+    snap->n = snap->size < max ? snap->size : max;
+    snap->value = malloc(snap->n * sizeof(char *));
+    bool ok = snap->value || !snap->n;
+    cq_node_t *node = head;
+    for (size_t i = 0; ok && i < snap->n; i++) {
+        node = atomic_load(&node->next);
+        if (!(snap->value[i] = strdup(node->value))) {
+            snap->n = i;
+            ok = false;
+        }
+    }
+    epoch_exit();
+
+    if (!ok)
+        cq_snapshot_free(snap);
+    return ok;
+}
+
+void cq_snapshot_free(cq_snapshot_t *snap)
+{
+    for (size_t i = 0; i < snap->n; i++)
+        free(snap->value[i]);
+    free(snap->value);
+    snap->value = NULL;
+    snap->n = 0;
+}
+
+/* Stress test
+ *
+ * Items are the producer number and a sequence number, written out as 16
+ * hex digits. A queue only ever holds a run of the items of each producer,
+ * in order, which is what snapshots are checked for.
+ */
+
+#define ITEM_LEN 16
+#define SEQ_BITS 40
+
+static struct {
+    cqueue_t *q;
+    int producers;
+    long items;
+    atomic_int producers_done;
+    atomic_int consumers_done;
+    atomic_uchar *seen; /* Times each item was removed */
+    atomic_long out_of_order;
+    atomic_bool failed; /* An insertion failed */
+} stress;
+
+static void encode_item(char *buf, uint64_t item)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (int i = ITEM_LEN - 1; i >= 0; i--, item >>= 4)
+        buf[i] = hex[item & 0xf];
+    buf[ITEM_LEN] = '\0';
+}
+
+static uint64_t decode_item(const char *buf)
+{
+    uint64_t item = 0;
+    for (int i = 0; i < ITEM_LEN; i++) {
+        char c = buf[i];
+        item = item << 4 | (c <= '9' ? c - '0' : c - 'a' + 10);
+    }
+    return item;
+}
+
+static void *producer(void *arg)
+{
+    uint64_t id = (uintptr_t) arg;
+    char buf[ITEM_LEN + 1];
+    for (long seq = 0; seq < stress.items; seq++) {
+        encode_item(buf, id << SEQ_BITS | seq);
+        if (!cq_insert_tail(stress.q, buf)) {
+            atomic_store(&stress.failed, true);
+            break;
+        }
+    }
+    atomic_fetch_add(&stress.producers_done, 1);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    long *last = malloc(stress.producers * sizeof(long));
+    if (!last)
+        return NULL;
+    for (int i = 0; i < stress.producers; i++)
+        last[i] = -1;
+
+    char buf[ITEM_LEN + 1];
+    long out_of_order = 0;
+    while (1) {
+        /* Producers must be done before the queue is found empty */
+        bool done = atomic_load(&stress.producers_done) == stress.producers;
+        if (!cq_remove_head(stress.q, buf, sizeof(buf))) {
+            if (done)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        uint64_t item = decode_item(buf);
+        uint64_t id = item >> SEQ_BITS;
+        long seq = item & ((1ULL << SEQ_BITS) - 1);
+        if (id >= (uint64_t) stress.producers || seq >= stress.items) {
+            out_of_order++; /* Not an item at all */
+            continue;
+        }
+        atomic_fetch_add_explicit(&stress.seen[id * stress.items + seq], 1,
+                                  memory_order_relaxed);
+        if (seq <= last[id])
+            out_of_order++;
+        last[id] = seq;
+    }
+
+    atomic_fetch_add(&stress.out_of_order, out_of_order);
+    free(last);
+    atomic_fetch_add(&stress.consumers_done, 1);
+    return NULL;
+}
+
+/* Return whether a snapshot holds a run of each producer's items */
+static bool check_snapshot(const cq_snapshot_t *snap, long *last)
+{
+    if (snap->n != snap->size)
+        return false;
+    for (int i = 0; i < stress.producers; i++)
+        last[i] = -1;
+    for (size_t i = 0; i < snap->n; i++) {
+        if (strlen(snap->value[i]) != ITEM_LEN)
+            return false;
+        uint64_t item = decode_item(snap->value[i]);
+        uint64_t id = item >> SEQ_BITS;
+        long seq = item & ((1ULL << SEQ_BITS) - 1);
+        if (id >= (uint64_t) stress.producers || seq >= stress.items)
+            return false;
+        if (last[id] >= 0 && seq != last[id] + 1)
+            return false;
+        last[id] = seq;
+    }
+    return true;
+}
+
+/* Take snapshots on this thread until the consumers are done */
+static void take_snapshots(cq_stress_t *st)
+{
+    long *last = malloc(stress.producers * sizeof(long));
+    if (!last) {
+        st->snapshot_errors++;
+        return;
+    }
+    while (atomic_load(&stress.consumers_done) < st->consumers) {
+        cq_snapshot_t snap;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ok = cq_snapshot(stress.q, SIZE_MAX, &snap);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!ok) {
+            st->snapshot_errors++;
+            continue;
+        }
+
+        st->snapshot_seconds += (end.tv_sec - start.tv_sec) +
+                                (end.tv_nsec - start.tv_nsec) / 1e9;
+        st->snapshots++;
+        st->snapshot_items += snap.n;
+        st->snapshot_retries += snap.retries;
+        st->snapshot_errors += !check_snapshot(&snap, last);
+        cq_snapshot_free(&snap);
+    }
+    free(last);
+}
+
+bool cq_stress(cq_kind_t kind, cq_stress_t *st)
+{
+    size_t total = (size_t) st->producers * st->items;
+    int n_threads = st->producers + st->consumers;
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    stress.seen = calloc(total, sizeof(atomic_uchar));
+    stress.q = cq_new(kind);
+    if (!threads || !stress.seen || !stress.q) {
+        free(threads);
+        free(stress.seen);
+        cq_free(stress.q);
+        return false;
+    }
+    stress.producers = st->producers;
+    stress.items = st->items;
+    atomic_store(&stress.producers_done, 0);
+    atomic_store(&stress.consumers_done, 0);
+    atomic_store(&stress.out_of_order, 0);
+    atomic_store(&stress.failed, false);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Leave signals such as SIGALRM to the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int started = 0;
+    for (int i = 0; i < st->consumers; i++, started++) {
+        if (pthread_create(&threads[started], NULL, consumer, NULL) != 0)
+            break;
+    }
+    bool ok = started == st->consumers;
+    for (int i = 0; ok && i < st->producers; i++, started++) {
+        if (pthread_create(&threads[started], NULL, producer,
+                           (void *) (uintptr_t) i) != 0)
+            ok = false;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* Consumers stop once all producers are done, started or not */
+    if (!ok)
+        atomic_store(&stress.producers_done, st->producers);
+    st->snapshots = st->snapshot_items = 0;
+    st->snapshot_retries = st->snapshot_errors = 0;
+    st->snapshot_seconds = 0;
+    if (ok && st->snapshot)
+        take_snapshots(st);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    st->seconds = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+    st->lost = st->duplicated = 0;
+    for (size_t i = 0; i < total; i++) {
+        unsigned char n = atomic_load_explicit(&stress.seen[i],
+                                               memory_order_relaxed);
+        st->lost += !n;
+        st->duplicated += n > 1;
+    }
+    st->out_of_order = atomic_load(&stress.out_of_order);
+    ok = ok && !atomic_load(&stress.failed);
+
+    cq_free(stress.q);
+    stress.q = NULL;
+    free(stress.seen);
+    stress.seen = NULL;
+    free(threads);
+    return ok;
+}
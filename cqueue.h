@@ -0,0 +1,81 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Queue of strings shared by any number of producer and consumer threads.
+ *
+ * Strings go in at the tail and come out at the head, with the semantics of
+ * q_insert_tail() and q_remove_head(): the string is copied in, and copied
+ * out into the caller's buffer. Both kinds of queue are linearizable.
+ */
+
+typedef enum {
+    CQ_LOCK_FREE, /* Michael-Scott queue, nodes reclaimed by epochs */
+    CQ_TWO_LOCK,  /* Michael-Scott queue with one lock for each end */
+} cq_kind_t;
+
+typedef struct cqueue cqueue_t;
+
+/* Create an empty queue. Return NULL if allocation failed */
+cqueue_t *cq_new(cq_kind_t kind);
+
+/* Free a queue and the strings left in it. No other thread may be using
+ * the queue.
+ */
+void cq_free(cqueue_t *q);
+
+/* Insert a copy of s at the tail. Return false if allocation failed */
+bool cq_insert_tail(cqueue_t *q, const char *s);
+
+/* Remove the string at the head, copying up to bufsize - 1 characters of it
+ * into sp unless sp is NULL. Return false if the queue was empty.
+ */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize);
+
+/* The strings in a queue at one instant, copied while producers and
+ * consumers go on
+ */
+typedef struct {
+    size_t size;  /* Strings in the queue */
+    size_t n;     /* Strings copied, the first n of them */
+    char **value; /* Copies, in queue order */
+    long retries; /* Times the ends moved while being read */
+} cq_snapshot_t;
+
+/* Take a snapshot of q, copying up to max strings. Return false if
+ * allocation failed.
+ */
+bool cq_snapshot(cqueue_t *q, size_t max, cq_snapshot_t *snap);
+
+/* Free the copies in a snapshot */
+void cq_snapshot_free(cq_snapshot_t *snap);
+
+/* Stress test: producers insert items strings each while consumers remove
+ * them all. Every item removed is checked off, and each consumer checks that
+ * the items of every producer reach it in the order they were inserted, as
+ * any linearizable FIFO queue guarantees. Snapshots taken meanwhile must
+ * each hold a run of every producer's items, in order.
+ */
+typedef struct {
+    int producers, consumers;
+    long items;           /* Inserted by each producer */
+    double seconds;       /* Elapsed time */
+    long lost;            /* Items never removed */
+    long duplicated;      /* Items removed more than once */
+    long out_of_order;    /* Items removed before an earlier one */
+    bool snapshot;        /* Take snapshots on this thread meanwhile */
+    long snapshots;       /* Snapshots taken */
+    long snapshot_items;  /* Strings copied by all of them */
+    long snapshot_retries;
+    long snapshot_errors; /* Snapshots not holding runs of items, in order */
+    double snapshot_seconds; /* Time taken by all of them */
+} cq_stress_t;
+
+/* Run the stress test with the counts set in st, and fill in the rest.
+ * Return false if the threads could not be started.
+ */
+bool cq_stress(cq_kind_t kind, cq_stress_t *st);
+
+#endif /* LAB0_CQUEUE_H */
@@ -0,0 +1,145 @@
+/**
+ * Empirical complexity estimation.
+ *
+ * Given the time an operation takes at several input sizes, fit
+ * t = coef * f(n) for every candidate f, minimizing the squared residuals
+ * relative to the measured times, and pick the candidate whose root mean
+ * square relative residual is the smallest. Every candidate has a single
+ * parameter, so the fits compare fairly. The sizes should grow geometrically
+ * to tell the candidates apart; relative residuals let the small sizes count
+ * as much as the large ones.
+ *
+ * An operation is within a bound unless a class above it fits clearly
+ * better. Over a factor of 128 in size, a class one log n factor apart is
+ * hard to tell from noise, so as a guard the time per unit of the bound may
+ * also grow by no more than GROWTH_SLACK log n factors over the sizes. That
+ * still catches O(n^1.5) or O(n log^2 n) against O(n). Caches get in the
+ * way of both: once the working set spills out of a level, the time per
+ * element goes up, much like an extra log n factor, so the times should
+ * have that slowdown divided out first (see dut_scaling()).
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "complexity.h"
+
+/* How much larger the residuals at the bound may be than the best ones */
+#define FIT_SLACK 2.0
+
+/* Log n factors the time per unit of the bound may grow by */
+#define GROWTH_SLACK 1.5
+
+static const char *names[N_COMPLEXITIES] = {
+    [COMPLEXITY_1] = "O(1)",
+    [COMPLEXITY_N] = "O(n)",
+    [COMPLEXITY_N_LOG_N] = "O(n log n)",
+    [COMPLEXITY_N2] = "O(n^2)",
+};
+
+const char *complexity_name(complexity_t c)
+{
+    return c < N_COMPLEXITIES ? names[c] : "?";
+}
+
+bool complexity_parse(const char *s, complexity_t *c)
+{
+    char buf[16];
+    size_t len = 0;
+
+    /* Compare without "O(", ")" and blanks, e.g. "nlogn" for O(n log n) */
+    if (s[0] == 'O' && s[1] == '(')
+        s += 2;
+    for (; *s && *s != ')' && len < sizeof(buf) - 1; s++) {
+        if (*s != ' ')
+            buf[len++] = *s;
+    }
+    buf[len] = '\0';
+
+    static const char *forms[N_COMPLEXITIES] = {
+        [COMPLEXITY_1] = "1",
+        [COMPLEXITY_N] = "n",
+        [COMPLEXITY_N_LOG_N] = "nlogn",
+        [COMPLEXITY_N2] = "n^2",
+    };
+    for (complexity_t i = 0; i < N_COMPLEXITIES; i++) {
+        if (!strcmp(buf, forms[i])) {
+            *c = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static double complexity_f(complexity_t c, double n)
+{
+    switch (c) {
+    case COMPLEXITY_N:
+        return n;
+    case COMPLEXITY_N_LOG_N:
+        return n * log2(n);
+    case COMPLEXITY_N2:
+        return n * n;
+    default:
+        return 1.0;
+    }
+}
+
+void complexity_fit(const double *n,
+                    const double *t,
+                    int count,
+                    complexity_fit_t *fit)
+{
+    double n_min = count ? n[0] : 1.0, n_max = n_min;
+    for (int i = 0; i < count; i++) {
+        n_min = fmin(n_min, n[i]);
+        n_max = fmax(n_max, n[i]);
+    }
+    fit->log_growth = n_min > 1 ? log(n_max) / log(n_min) : 1.0;
+
+    fit->best = COMPLEXITY_1;
+    for (complexity_t c = 0; c < N_COMPLEXITIES; c++) {
+        /* Minimize sum((1 - coef * u)^2) with u = f(n) / t */
+        double su = 0.0, suu = 0.0;
+        for (int i = 0; i < count; i++) {
+            double u = t[i] > 0 ? complexity_f(c, n[i]) / t[i] : 0.0;
+            su += u;
+            suu += u * u;
+        }
+        fit->coef[c] = suu > 0 ? su / suu : 0.0;
+
+        double rss = 0.0;
+        for (int i = 0; i < count; i++) {
+            double u = t[i] > 0 ? complexity_f(c, n[i]) / t[i] : 0.0;
+            double r = 1.0 - fit->coef[c] * u;
+            rss += r * r;
+        }
+        fit->rms[c] = count ? sqrt(rss / count) : 0.0;
+        if (fit->rms[c] < fit->rms[fit->best])
+            fit->best = c;
+
+        /* Slope of log(t / f(n)) against log(n) */
+        double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+        int valid = 0;
+        for (int i = 0; i < count; i++) {
+            if (t[i] <= 0)
+                continue;
+            double x = log(n[i]), y = log(t[i] / complexity_f(c, n[i]));
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+            valid++;
+        }
+        double den = valid * sxx - sx * sx;
+        double slope = den > 0 ? (valid * sxy - sx * sy) / den : 0.0;
+        fit->growth[c] = exp(slope * (log(n_max) - log(n_min)));
+    }
+}
+
+bool complexity_within(const complexity_fit_t *fit, complexity_t bound)
+{
+    if (fit->best > bound && fit->rms[bound] > FIT_SLACK * fit->rms[fit->best])
+        return false;
+    return fit->growth[bound] <= GROWTH_SLACK * fit->log_growth;
+}
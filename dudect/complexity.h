@@ -0,0 +1,41 @@
+#ifndef DUDECT_COMPLEXITY_H
+#define DUDECT_COMPLEXITY_H
+
+#include <stdbool.h>
+
+/* Candidate complexity classes, from the slowest growing one */
+typedef enum {
+    COMPLEXITY_1,
+    COMPLEXITY_N,
+    COMPLEXITY_N_LOG_N,
+    COMPLEXITY_N2,
+    N_COMPLEXITIES
+} complexity_t;
+
+/* Least-squares fit of timings against each complexity class */
+typedef struct {
+    complexity_t best;           /* class with the smallest rms */
+    double coef[N_COMPLEXITIES]; /* fitted time per unit of f(n) */
+    double rms[N_COMPLEXITIES];  /* of the residuals relative to the times */
+    /* Factor by which t / f(n) grows from the smallest to the largest n,
+     * along a power law fitted through all the points
+     */
+    double growth[N_COMPLEXITIES];
+    double log_growth; /* Factor by which log n grows over the sizes */
+} complexity_fit_t;
+
+const char *complexity_name(complexity_t c);
+
+/* Parse a class written as in complexity_name(), or without the O( ) */
+bool complexity_parse(const char *s, complexity_t *c);
+
+/* Fit t[i] = coef * f(n[i]) for every class f over count points */
+void complexity_fit(const double *n,
+                    const double *t,
+                    int count,
+                    complexity_fit_t *fit);
+
+/* Whether the timings are consistent with growing no faster than bound */
+bool complexity_within(const complexity_fit_t *fit, complexity_t bound);
+
+#endif
@@ -1,5 +1,8 @@
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "constant.h"
@@ -8,18 +11,13 @@
 #include "random.h"
 
 /* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+ * we do not want the test to affect the original functionality.
+ * Every measuring thread has its own.
  */
-static struct list_head *l = NULL;
+static __thread struct list_head *l = NULL;
 
 #define dut_new() ((void) (l = q_new()))
 
-#define dut_size(n)                                \
-    do {                                           \
-        for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
-    } while (0)
-
 #define dut_insert_head(s, n)    \
     do {                         \
         int j = n;               \
@@ -27,17 +25,178 @@ static struct list_head *l = NULL;
             q_insert_head(l, s); \
     } while (0)
 
-#define dut_insert_tail(s, n)    \
-    do {                         \
-        int j = n;               \
-        while (j--)              \
-            q_insert_tail(l, s); \
-    } while (0)
-
 #define dut_free() ((void) (q_free(l)))
 
-static char random_string[N_MEASURES][8];
-static int random_string_iter = 0;
+static __thread char random_string[N_MEASURES][8];
+static __thread int random_string_iter = 0;
+
+/* Argument and result of the operation under test */
+static __thread char *dut_str;
+static __thread element_t *dut_removed;
+
+/* q_merge() runs on queue l split into this many sorted queues */
+#define MERGE_QUEUES 4
+
+static __thread queue_contex_t dut_ctx[MERGE_QUEUES];
+static __thread struct list_head dut_chain;
+
+/* The change of the queue length depends on its contents */
+#define DELTA_ANY INT_MIN
+
+/* An operation under test */
+typedef struct {
+    char *name;
+    complexity_t complexity; /* declared bound */
+    /* Length of the queue to run on, given the input of a measurement. The
+     * input is zero for every measurement of class 0.
+     */
+    int (*length)(uint16_t input);
+    /* The timed call, on queue l */
+    void (*run)(void);
+    int delta; /* change of the queue length made by the call */
+    /* Untimed preparation of queue l and cleanup after the call, if any */
+    void (*setup)(void);
+    void (*teardown)(void);
+} dut_t;
+
+static int length_any(uint16_t input)
+{
+    return input % 10000;
+}
+
+static int length_nonempty(uint16_t input)
+{
+    return input % 10000 + 1;
+}
+
+static void run_insert_head(void)
+{
+    q_insert_head(l, dut_str);
+}
+
+static void run_insert_tail(void)
+{
+    q_insert_tail(l, dut_str);
+}
+
+static void run_remove_head(void)
+{
+    dut_removed = q_remove_head(l, NULL, 0);
+}
+
+static void run_remove_tail(void)
+{
+    dut_removed = q_remove_tail(l, NULL, 0);
+}
+
+static void run_size(void)
+{
+    q_size(l);
+}
+
+static void run_delete_mid(void)
+{
+    q_delete_mid(l);
+}
+
+static void run_swap(void)
+{
+    q_swap(l);
+}
+
+static void run_reverse(void)
+{
+    q_reverse(l);
+}
+
+static void run_sort(void)
+{
+    q_sort(l, false);
+}
+
+static void run_delete_dup(void)
+{
+    q_delete_dup(l);
+}
+
+static void run_ascend(void)
+{
+    q_ascend(l);
+}
+
+static void run_descend(void)
+{
+    q_descend(l);
+}
+
+static void run_merge(void)
+{
+    q_merge(&dut_chain, false);
+}
+
+/* Deal the elements of l out to MERGE_QUEUES sorted queues, l being the
+ * first one
+ */
+static void setup_merge(void)
+{
+    int n = q_size(l);
+
+    INIT_LIST_HEAD(&dut_chain);
+    for (int i = 0; i < MERGE_QUEUES; i++) {
+        dut_ctx[i].q = i ? q_new() : l;
+        dut_ctx[i].size = 0;
+        dut_ctx[i].id = i;
+        list_add_tail(&dut_ctx[i].chain, &dut_chain);
+    }
+    for (int i = MERGE_QUEUES - 1; i > 0; i--) {
+        for (int j = n * i / MERGE_QUEUES; j < n * (i + 1) / MERGE_QUEUES;
+             j++) {
+            list_move(l->prev, dut_ctx[i].q);
+            dut_ctx[i].size++;
+        }
+    }
+    dut_ctx[0].size = n / MERGE_QUEUES;
+    for (int i = 0; i < MERGE_QUEUES; i++)
+        q_sort(dut_ctx[i].q, false);
+}
+
+/* Everything ends up in l; free the other queues */
+static void teardown_merge(void)
+{
+    for (int i = 1; i < MERGE_QUEUES; i++)
+        q_free(dut_ctx[i].q);
+}
+
+static const dut_t duts[N_DUTS] = {
+    [DUT(insert_head)] = {"insert_head", COMPLEXITY_1, length_any,
+                          run_insert_head, 1},
+    [DUT(insert_tail)] = {"insert_tail", COMPLEXITY_1, length_any,
+                          run_insert_tail, 1},
+    [DUT(remove_head)] = {"remove_head", COMPLEXITY_1, length_nonempty,
+                          run_remove_head, -1},
+    [DUT(remove_tail)] = {"remove_tail", COMPLEXITY_1, length_nonempty,
+                          run_remove_tail, -1},
+    [DUT(size)] = {"size", COMPLEXITY_N, length_any, run_size, 0},
+    [DUT(delete_mid)] = {"delete_mid", COMPLEXITY_N, length_nonempty,
+                         run_delete_mid, -1},
+    [DUT(swap)] = {"swap", COMPLEXITY_N, length_any, run_swap, 0},
+    [DUT(reverse)] = {"reverse", COMPLEXITY_N, length_any, run_reverse, 0},
+    [DUT(sort)] = {"sort", COMPLEXITY_N_LOG_N, length_any, run_sort, 0},
+    [DUT(delete_dup)] = {"delete_dup", COMPLEXITY_N_LOG_N, length_any,
+                         run_delete_dup, DELTA_ANY},
+    [DUT(ascend)] = {"ascend", COMPLEXITY_N, length_any, run_ascend,
+                     DELTA_ANY},
+    [DUT(descend)] = {"descend", COMPLEXITY_N, length_any, run_descend,
+                      DELTA_ANY},
+    [DUT(merge)] = {"merge", COMPLEXITY_N_LOG_N, length_any, run_merge, 0,
+                    setup_merge, teardown_merge},
+};
+
+static const char *shape_names[N_SHAPES] = {
+#define _(x) [SHAPE_##x] = #x,
+    DUT_SHAPES
+#undef _
+};
 
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
@@ -45,6 +204,24 @@ void init_dut(void)
     l = NULL;
 }
 
+const char *dut_name(int mode)
+{
+    assert(mode >= 0 && mode < N_DUTS);
+    return duts[mode].name;
+}
+
+complexity_t dut_complexity(int mode)
+{
+    assert(mode >= 0 && mode < N_DUTS);
+    return duts[mode].complexity;
+}
+
+const char *shape_name(int shape)
+{
+    assert(shape >= 0 && shape < N_SHAPES);
+    return shape_names[shape];
+}
+
 static char *get_random_string(void)
 {
     random_string_iter = (random_string_iter + 1) % N_MEASURES;
@@ -53,110 +230,135 @@ static char *get_random_string(void)
 
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
-    randombytes(input_data, N_MEASURES * CHUNK_SIZE);
+    prng_bytes(input_data, N_MEASURES * CHUNK_SIZE);
+    prng_bytes(classes, N_MEASURES);
     for (size_t i = 0; i < N_MEASURES; i++) {
-        classes[i] = randombit();
+        classes[i] &= 1;
         if (classes[i] == 0)
             memset(input_data + (size_t) i * CHUNK_SIZE, 0, CHUNK_SIZE);
     }
 
-    for (size_t i = 0; i < N_MEASURES; ++i) {
-        /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
+    /* Generate random strings */
+    prng_bytes(random_string, sizeof(random_string));
+    for (size_t i = 0; i < N_MEASURES; ++i)
         random_string[i][7] = 0;
+}
+
+/* Value of element i of n in the given shape */
+static uint32_t shape_value(int shape, int i, int n)
+{
+    switch (shape) {
+    case SHAPE_random:
+        return prng_bounded(100000000);
+    case SHAPE_sorted:
+        return i;
+    case SHAPE_reversed:
+        return n - 1 - i;
+    case SHAPE_sawtooth:
+        /* Ascending runs of about sqrt(n) elements */
+        return i % ((int) sqrt(n) + 1);
+    default:
+        return 0;
+    }
+}
+
+/* Fill queue l with n elements whose values follow the shape */
+static void dut_fill(int n, int shape)
+{
+    /* One string n times, as dudect has always measured */
+    if (shape == SHAPE_equal) {
+        dut_insert_head(get_random_string(), n);
+        return;
+    }
+
+    /* Zero padded, so that string order is numeric order */
+    char value[16];
+    for (int i = n - 1; i >= 0; i--) {
+        snprintf(value, sizeof(value), "%08u", shape_value(shape, i, n));
+        q_insert_head(l, value);
     }
 }
 
+/* Time one call on a fresh queue of n elements. Return false if the call
+ * did not change the queue length as expected.
+ *
+ * The length before the call is known from n rather than taken with
+ * q_size(), which would walk the whole queue right before the timed call
+ * and leave a cache footprint proportional to the input.
+ */
+static bool measure_once(const dut_t *dut,
+                         int n,
+                         int shape,
+                         int64_t *before_ticks,
+                         int64_t *after_ticks)
+{
+    dut_str = get_random_string();
+    dut_new();
+    dut_fill(n, shape);
+    if (dut->setup)
+        dut->setup();
+    *before_ticks = cpucycles_begin();
+    dut->run();
+    *after_ticks = cpucycles_end();
+    if (dut->teardown)
+        dut->teardown();
+    int after_size = q_size(l);
+    if (dut_removed) {
+        q_release_element(dut_removed);
+        dut_removed = NULL;
+    }
+    dut_free();
+    return dut->delta == DELTA_ANY || after_size == n + dut->delta;
+}
+
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
-    assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
-
-    switch (mode) {
-    case DUT(insert_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
-        }
-        break;
-    case DUT(insert_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
-        }
-        break;
-    case DUT(remove_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
-        }
-        break;
-    case DUT(remove_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
-        }
-        break;
-    default:
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+    assert(mode >= 0 && mode < N_DUTS);
+    const dut_t *dut = &duts[mode];
+
+    for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+        int n = dut->length(*(uint16_t *) (input_data + i * CHUNK_SIZE));
+        if (!measure_once(dut, n, SHAPE_equal, &before_ticks[i],
+                          &after_ticks[i])) {
+            return false;
         }
     }
     return true;
 }
+
+/* Time one call on a queue of n elements, for fitting the complexity */
+bool measure_size(int64_t *cycles, int n, int shape, int mode)
+{
+    assert(mode >= 0 && mode < N_DUTS);
+    int64_t before_ticks, after_ticks;
+    bool ok = measure_once(&duts[mode], n, shape, &before_ticks, &after_ticks);
+    *cycles = after_ticks - before_ticks - cpucycles_overhead();
+    if (*cycles < 0)
+        *cycles = 0;
+    return ok;
+}
+
+/* Time a plain walk over a fresh queue of n elements */
+bool measure_walk(int64_t *cycles, int n, int shape)
+{
+    dut_new();
+    dut_fill(n, shape);
+    int len = 0;
+    struct list_head *node;
+    int64_t before_ticks = cpucycles_begin();
+    list_for_each (node, l) {
+        /* Dirty the node, as operations that relink the queue do */
+        *(struct list_head *volatile *) &node->prev = node->prev;
+        len++;
+    }
+    int64_t after_ticks = cpucycles_end();
+    dut_free();
+
+    *cycles = after_ticks - before_ticks - cpucycles_overhead();
+    if (*cycles < 0)
+        *cycles = 0;
+    return len == n;
+}
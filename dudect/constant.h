@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "complexity.h"
+
 /* Number of measurements per test */
 #define N_MEASURES 150
 
@@ -12,25 +14,60 @@
 
 #define DROP_SIZE 20
 
+/* Operations expected to run in constant time, checked with dudect */
 #define DUT_FUNCS  \
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
     _(remove_tail)
 
+/* Operations whose running time is only fitted over growing queue sizes */
+#define DUT_SCALING_FUNCS \
+    _(size)               \
+    _(delete_mid)         \
+    _(swap)               \
+    _(reverse)            \
+    _(sort)               \
+    _(delete_dup)         \
+    _(ascend)             \
+    _(descend)            \
+    _(merge)
+
 #define DUT(x) DUT_##x
 
 enum {
 #define _(x) DUT(x),
     DUT_FUNCS
+    DUT_SCALING_FUNCS
+#undef _
+    N_DUTS
+};
+
+/* Orders of the values in the queue an operation is fitted over */
+#define DUT_SHAPES \
+    _(random)      \
+    _(sorted)      \
+    _(reversed)    \
+    _(equal)       \
+    _(sawtooth)
+
+enum {
+#define _(x) SHAPE_##x,
+    DUT_SHAPES
 #undef _
+    N_SHAPES
 };
 
 void init_dut();
+const char *dut_name(int mode);
+complexity_t dut_complexity(int mode);
+const char *shape_name(int shape);
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode);
+bool measure_size(int64_t *cycles, int n, int shape, int mode);
+bool measure_walk(int64_t *cycles, int n, int shape);
 
 #endif
@@ -0,0 +1,72 @@
+/**
+ * Calibration of the cycle counter.
+ *
+ * On x86 the time stamp counter ticks at a constant rate on every CPU of
+ * the last decade, which is not the rate the core runs at, so it is
+ * calibrated against the monotonic clock. On Arm the generic timer reports
+ * its own frequency.
+ */
+
+#include <time.h>
+
+#include "cpucycles.h"
+
+/* Wall clock time the x86 counter is calibrated over */
+#define CALIBRATE_NS 10000000
+
+/* Back to back reads taken to find the overhead */
+#define OVERHEAD_READS 1000
+
+static double ticks_per_ns = 0;
+static int64_t overhead = -1;
+
+int64_t cpucycles_overhead(void)
+{
+    if (overhead >= 0)
+        return overhead;
+
+    int64_t min = INT64_MAX;
+    for (int i = 0; i < OVERHEAD_READS; i++) {
+        int64_t start = cpucycles_begin();
+        int64_t cycles = cpucycles_end() - start;
+        if (cycles < min)
+            min = cycles;
+    }
+    overhead = min > 0 ? min : 0;
+    return overhead;
+}
+
+#if !defined(__aarch64__)
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
+
+double cpucycles_per_ns(void)
+{
+    if (ticks_per_ns > 0)
+        return ticks_per_ns;
+
+#if defined(__aarch64__)
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    ticks_per_ns = freq / 1e9;
+#else
+    double start_ns = now_ns(), end_ns;
+    int64_t start = cpucycles_begin();
+    while ((end_ns = now_ns()) - start_ns < CALIBRATE_NS)
+        ;
+    ticks_per_ns = (cpucycles_end() - start) / (end_ns - start_ns);
+#endif
+    if (ticks_per_ns <= 0)
+        ticks_per_ns = 1;
+    return ticks_per_ns;
+}
+
+double cpucycles_to_ns(int64_t ticks)
+{
+    return ticks / cpucycles_per_ns();
+}
@@ -4,13 +4,17 @@
 #include <stdint.h>
 
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
-static inline int64_t cpucycles(void)
+
+/* Read the counter at the start of a measured region. Everything before it
+ * has completed, and nothing after it has started, when the counter is read.
+ */
+static inline int64_t cpucycles_begin(void)
 {
 #if defined(__i386__) || defined(__x86_64__)
     unsigned int hi, lo;
-    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    __asm__ volatile("lfence\n\trdtsc\n\tlfence"
+                     : "=a"(lo), "=d"(hi)::"memory");
     return ((int64_t) lo) | (((int64_t) hi) << 32);
-
 #elif defined(__aarch64__)
     uint64_t val;
     /* According to ARM DDI 0487F.c, from Armv8.0 to Armv8.5 inclusive, the
@@ -19,11 +23,41 @@ static inline int64_t cpucycles(void)
      * bits wide and it is attributed with the flag 'cap_user_time_short'
      * is true.
      */
-    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
+/* Read the counter at the end of a measured region, once all of it has
+ * completed. rdtscp waits for the preceding instructions but lets later ones
+ * start early, hence the trailing lfence.
+ */
+static inline int64_t cpucycles_end(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\tlfence"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
     return val;
 #else
 #error Unsupported Architecture
 #endif
 }
 
+/* Smallest count between cpucycles_begin() and cpucycles_end() with nothing
+ * in between, to be subtracted from measurements
+ */
+int64_t cpucycles_overhead(void);
+
+/* Counter ticks per nanosecond */
+double cpucycles_per_ns(void);
+
+double cpucycles_to_ns(int64_t ticks);
+
 #endif
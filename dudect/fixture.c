@@ -14,36 +14,74 @@
  *    those measurements could correspond to the execution being interrupted
  *    by the OS.) Setting a threshold value for this is not obvious; we just
  *    keep the x% percent fastest timings, and repeat for several values of x.
+ *    The thresholds are estimated with P^2 on a few calibration batches,
+ *    which are not used otherwise, and stay fixed for the rest of the try.
  *
  *  - the previous observation is highly heuristic. We also keep the uncropped
  *    measurement time and do a t-test on that.
  *
  *  - we also test for unequal variances (second order test), but this is
  *    probably redundant since we're doing as well a t-test on cropped
- *    measurements (non-linear transform)
+ *    measurements (non-linear transform). It is a t-test on the squared
+ *    distance of each timing from the mean of its class, the means being
+ *    those of the calibration batches.
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#endif
+
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../console.h"
 #include "../random.h"
 
 #include "constant.h"
 #include "fixture.h"
+#include "percentile.h"
 #include "ttest.h"
 
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 
-static t_context_t *t;
+/* Batches measured to estimate the cropping thresholds */
+#define CALIBRATE_BATCHES 4
+
+#define N_PERCENTILES 100
+
+/* Uncropped, one per cropping threshold, then second order */
+#define N_TESTS (1 + N_PERCENTILES + 1)
+#define SECOND_ORDER_TEST (N_TESTS - 1)
+
+/* Cropped and second order tests can stop a try as soon as they hold this
+ * many measurements and show an overwhelming leak. At the moderate threshold
+ * they only count with ENOUGH_MEASURE of them: without the outliers they are
+ * sharp enough to see the cache footprint of the longer queues in class 1,
+ * which is there for O(1) operations too.
+ */
+#define MIN_TEST_MEASURE (ENOUGH_MEASURE / 10)
+
+/* Calls timed at every size when fitting the complexity */
+#define SCALING_REPS 15
+
+/* Smallest size fitted over, doubled up to SCALING_SIZES sizes */
+#define SCALING_MIN_SIZE 32
+
+/* Upper bound on measuring threads */
+#define MAX_WORKERS 16
+
+int dudect_threads = 0;
 
 /* threshold values for Welch's t-test */
 enum {
@@ -51,11 +89,59 @@ enum {
     t_threshold_moderate = 10, /* Test failed */
 };
 
+/* Measurement batches of one try are shared out among worker threads. Each
+ * worker measures on its own queue, computes the statistics of a batch
+ * locally and merges them into the shared context.
+ */
+static struct {
+    pthread_mutex_t lock;
+    int mode;
+    int next_batch; /* next batch to hand out */
+    int n_batches;
+    double thresholds[N_PERCENTILES]; /* fixed by calibration */
+    double mean[2];                   /* per class, fixed by calibration */
+    t_context_t t[N_TESTS];           /* merged statistics */
+    bool ok;                          /* no measurement went wrong */
+    bool stop;                        /* result is already conclusive */
+} run = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Buffers for measuring one batch */
+typedef struct {
+    int64_t *before_ticks;
+    int64_t *after_ticks;
+    int64_t *exec_times;
+    uint8_t *classes;
+    uint8_t *input_data;
+} batch_t;
+
 static void __attribute__((noreturn)) die(void)
 {
     exit(111);
 }
 
+static void batch_init(batch_t *b)
+{
+    b->before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
+    b->after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
+    b->exec_times = calloc(N_MEASURES, sizeof(int64_t));
+    b->classes = calloc(N_MEASURES, sizeof(uint8_t));
+    b->input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
+
+    if (!b->before_ticks || !b->after_ticks || !b->exec_times ||
+        !b->classes || !b->input_data) {
+        die();
+    }
+}
+
+static void batch_free(batch_t *b)
+{
+    free(b->before_ticks);
+    free(b->after_ticks);
+    free(b->exec_times);
+    free(b->classes);
+    free(b->input_data);
+}
+
 static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
@@ -64,7 +150,17 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static bool measure_batch(batch_t *b, int mode)
+{
+    prepare_inputs(b->input_data, b->classes);
+    bool ok = measure(b->before_ticks, b->after_ticks, b->input_data, mode);
+    differentiate(b->exec_times, b->before_ticks, b->after_ticks);
+    return ok;
+}
+
+static void update_statistics(t_context_t *t,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
 {
     for (size_t i = 0; i < N_MEASURES; i++) {
         int64_t difference = exec_times[i];
@@ -73,14 +169,40 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&t[0], difference, classes[i]);
+
+        /* do a t-test on cropped execution times, for several thresholds */
+        for (size_t k = 0; k < N_PERCENTILES; k++) {
+            if (difference < run.thresholds[k])
+                t_push(&t[1 + k], difference, classes[i]);
+        }
+
+        /* do a second order test */
+        double centered = difference - run.mean[classes[i]];
+        t_push(&t[SECOND_ORDER_TEST], centered * centered, classes[i]);
     }
 }
 
-static bool report(void)
+/* Largest t statistic among the uncropped test and the others holding at
+ * least min_measure measurements
+ */
+static double max_test(t_context_t *t, double min_measure)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
+    double max_t = fabs(t_compute(&t[0]));
+    for (size_t i = 1; i < N_TESTS; i++) {
+        if (t[i].n[0] + t[i].n[1] < min_measure)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (x > max_t)
+            max_t = x;
+    }
+    return max_t;
+}
+
+static bool report(t_context_t *t)
+{
+    double max_t = max_test(t, ENOUGH_MEASURE);
+    double number_traces_max_t = t[0].n[0] + t[0].n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
 
     printf("\033[A\033[2K");
@@ -116,60 +238,212 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* A leak this large will not go away with more measurements */
+static bool conclusive(t_context_t *t)
 {
-    int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
-    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
-    uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
+    return t[0].n[0] + t[0].n[1] >= ENOUGH_MEASURE / 10 &&
+           max_test(t, MIN_TEST_MEASURE) > t_threshold_bananas;
+}
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
-        die();
-    }
+/* Keep the thread on one CPU, so the cycle counter it reads is not switched
+ * under it.
+ */
+static void pin_thread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) cpu;
+#endif
+}
 
-    prepare_inputs(input_data, classes);
+/* Fix the cropping thresholds and class means from a few batches measured
+ * on this thread. Return false if a measurement went wrong.
+ */
+static bool calibrate(int mode)
+{
+    p2_t est[N_PERCENTILES];
+    double sum[2] = {0.0, 0.0}, count[2] = {0.0, 0.0};
+    batch_t b;
+    bool ok = true;
 
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    ret &= report();
+    /* Thresholds spread towards the right tail, as in the original dudect */
+    for (size_t k = 0; k < N_PERCENTILES; k++)
+        p2_init(&est[k],
+                1 - pow(0.5, 10 * (double) (k + 1) / N_PERCENTILES));
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
+    batch_init(&b);
+    init_dut();
+    for (int i = 0; i < CALIBRATE_BATCHES && ok; i++) {
+        ok = measure_batch(&b, mode);
+        for (size_t j = 0; j < N_MEASURES; j++) {
+            int64_t difference = b.exec_times[j];
+            if (difference <= 0)
+                continue;
+            for (size_t k = 0; k < N_PERCENTILES; k++)
+                p2_push(&est[k], difference);
+            sum[b.classes[j]] += difference;
+            count[b.classes[j]]++;
+        }
+    }
+    batch_free(&b);
 
-    return ret;
+    for (size_t k = 0; k < N_PERCENTILES; k++)
+        run.thresholds[k] = p2_value(&est[k]);
+    for (int c = 0; c < 2; c++)
+        run.mean[c] = count[c] ? sum[c] / count[c] : 0.0;
+    return ok;
 }
 
-static void init_once(void)
+static void *worker(void *arg)
 {
+    batch_t b;
+    batch_init(&b);
+
+    if (arg)
+        pin_thread(*(int *) arg);
     init_dut();
-    t_init(t);
+
+    for (;;) {
+        pthread_mutex_lock(&run.lock);
+        bool more = !run.stop && run.next_batch < run.n_batches;
+        run.next_batch += more;
+        pthread_mutex_unlock(&run.lock);
+        if (!more)
+            break;
+
+        t_context_t t[N_TESTS];
+        for (size_t i = 0; i < N_TESTS; i++)
+            t_init(&t[i]);
+        bool ok = measure_batch(&b, run.mode);
+        update_statistics(t, b.exec_times, b.classes);
+
+        pthread_mutex_lock(&run.lock);
+        for (size_t i = 0; i < N_TESTS; i++)
+            t_merge(&run.t[i], &t[i]);
+        run.ok &= ok;
+        report(run.t);
+        if (!ok || conclusive(run.t))
+            run.stop = true;
+        pthread_mutex_unlock(&run.lock);
+    }
+
+    batch_free(&b);
+    return NULL;
+}
+
+static int n_workers(void)
+{
+    int n = dudect_threads;
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    return n < MAX_WORKERS ? n : MAX_WORKERS;
+}
+
+/* Run one try with batches spread over n threads. Return the verdict */
+static bool doit(int mode, int n)
+{
+    pthread_t threads[MAX_WORKERS];
+    int cpus[MAX_WORKERS];
+    int started = 0;
+
+    run.mode = mode;
+    run.next_batch = 0;
+    run.n_batches = ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
+    run.ok = true;
+    run.stop = false;
+    for (size_t i = 0; i < N_TESTS; i++)
+        t_init(&run.t[i]);
+
+    if (!calibrate(mode))
+        return false;
+
+    if (n > 1) {
+        /* Leave signals such as SIGALRM to the main thread */
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        for (; started < n; started++) {
+            cpus[started] = ncpu > 0 ? started % ncpu : 0;
+            if (pthread_create(&threads[started], NULL, worker,
+                               &cpus[started]) != 0)
+                break;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+
+    /* Measure on this thread if no worker could be started */
+    if (!started)
+        worker(NULL);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    return run.ok && report(run.t);
 }
 
 static bool test_const(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_context_t));
+    int n = n_workers();
 
     for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
-        init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        result = doit(mode, n);
         printf("\033[A\033[2K\033[A\033[2K");
         if (result)
             break;
     }
-    free(t);
     return result;
 }
 
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+bool dut_scaling(int mode, int shape, dut_scaling_t *result)
+{
+    uint8_t input_data[N_MEASURES * CHUNK_SIZE], classes[N_MEASURES];
+    int64_t cycles[SCALING_REPS], walk[SCALING_REPS];
+    double scaled[SCALING_SIZES], walk_min = 0.0;
+
+    /* Only for the random strings */
+    prepare_inputs(input_data, classes);
+    init_dut();
+
+    for (int i = 0; i < SCALING_SIZES; i++) {
+        int n = SCALING_MIN_SIZE << i;
+        for (int r = 0; r < SCALING_REPS; r++) {
+            if (!measure_size(&cycles[r], n, shape, mode) ||
+                !measure_walk(&walk[r], n, shape))
+                return false;
+        }
+        qsort(cycles, SCALING_REPS, sizeof(int64_t), cmp_int64);
+        qsort(walk, SCALING_REPS, sizeof(int64_t), cmp_int64);
+        result->n[i] = n;
+        result->cycles[i] = cycles[SCALING_REPS / 2];
+
+        /* Walk cycles per element, relative to the smallest size */
+        double per_element = (double) walk[SCALING_REPS / 2] / n;
+        if (!i)
+            walk_min = per_element;
+        result->memory[i] = walk_min > 0 && per_element > walk_min
+                                ? per_element / walk_min
+                                : 1.0;
+        scaled[i] = result->cycles[i] / result->memory[i];
+    }
+
+    complexity_fit(result->n, scaled, SCALING_SIZES, &result->fit);
+    return true;
+}
+
 #define DUT_FUNC_IMPL(op) \
     bool is_##op##_const(void) { return test_const(#op, DUT(op)); }
 
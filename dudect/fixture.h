@@ -4,9 +4,31 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of threads measuring in parallel, 0 for one per online CPU */
+extern int dudect_threads;
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
 #undef _
 
+/* Queue sizes the running time of an operation is fitted over */
+#define SCALING_SIZES 8
+
+typedef struct {
+    double n[SCALING_SIZES];
+    double cycles[SCALING_SIZES]; /* median over several calls */
+    /* How many times slower a walk over the queue is per element than at
+     * the smallest size, as it spills out of the caches
+     */
+    double memory[SCALING_SIZES];
+    complexity_fit_t fit; /* of cycles / memory */
+} dut_scaling_t;
+
+/* Time an operation over growing queues whose values follow the shape, and
+ * fit its complexity once the slowdown of the memory hierarchy is divided
+ * out. Return false if a call did not change the queue length as expected.
+ */
+bool dut_scaling(int mode, int shape, dut_scaling_t *result);
+
 #endif
@@ -0,0 +1,104 @@
+/**
+ * P^2 quantile estimator.
+ *
+ * Five markers track the minimum, the p/2, p and (1+p)/2 quantiles and the
+ * maximum. Each observation shifts the marker positions; a marker that
+ * drifts off its desired position by one or more is moved, and its height
+ * is adjusted with a piecewise-parabolic fit through its neighbours.
+ */
+
+#include "percentile.h"
+
+void p2_init(p2_t *est, double p)
+{
+    est->p = p;
+    est->count = 0;
+    for (int i = 0; i < 5; i++)
+        est->n[i] = i;
+    est->np[0] = 0;
+    est->np[1] = 2 * p;
+    est->np[2] = 4 * p;
+    est->np[3] = 2 + 2 * p;
+    est->np[4] = 4;
+    est->dn[0] = 0;
+    est->dn[1] = p / 2;
+    est->dn[2] = p;
+    est->dn[3] = (1 + p) / 2;
+    est->dn[4] = 1;
+}
+
+static double parabolic(const p2_t *est, int i, double d)
+{
+    const double *q = est->q, *n = est->n;
+    return q[i] + d / (n[i + 1] - n[i - 1]) *
+                      ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) /
+                           (n[i + 1] - n[i]) +
+                       (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) /
+                           (n[i] - n[i - 1]));
+}
+
+static double linear(const p2_t *est, int i, int d)
+{
+    const double *q = est->q, *n = est->n;
+    return q[i] + d * (q[i + d] - q[i]) / (n[i + d] - n[i]);
+}
+
+void p2_push(p2_t *est, double x)
+{
+    double *q = est->q, *n = est->n;
+
+    /* The first five observations become the initial markers, in order */
+    if (est->count < 5) {
+        int i = est->count++;
+        for (; i > 0 && q[i - 1] > x; i--)
+            q[i] = q[i - 1];
+        q[i] = x;
+        return;
+    }
+    est->count++;
+
+    /* Find the cell x falls in, extending the extremes if needed */
+    int k;
+    if (x < q[0]) {
+        q[0] = x;
+        k = 0;
+    } else if (x >= q[4]) {
+        q[4] = x;
+        k = 3;
+    } else {
+        for (k = 0; x >= q[k + 1]; k++)
+            ;
+    }
+
+    for (int i = k + 1; i < 5; i++)
+        n[i]++;
+    for (int i = 0; i < 5; i++)
+        est->np[i] += est->dn[i];
+
+    /* Move the middle markers back towards their desired positions */
+    for (int i = 1; i < 4; i++) {
+        double d = est->np[i] - n[i];
+        if ((d >= 1 && n[i + 1] - n[i] > 1) ||
+            (d <= -1 && n[i - 1] - n[i] < -1)) {
+            int s = d > 0 ? 1 : -1;
+            double h = parabolic(est, i, s);
+            if (q[i - 1] < h && h < q[i + 1])
+                q[i] = h;
+            else
+                q[i] = linear(est, i, s);
+            n[i] += s;
+        }
+    }
+}
+
+double p2_value(const p2_t *est)
+{
+    /* Too few observations for the markers: use the nearest rank */
+    if (est->count < 5) {
+        if (!est->count)
+            return 0;
+        int i = (int) (est->p * (est->count - 1) + 0.5);
+        return est->q[i];
+    }
+    return est->q[2];
+}
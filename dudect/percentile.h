@@ -0,0 +1,21 @@
+#ifndef DUDECT_PERCENTILE_H
+#define DUDECT_PERCENTILE_H
+
+/* Streaming estimate of one quantile in constant space, using the P^2
+ * algorithm (Jain and Chlamtac, "The P^2 Algorithm for Dynamic Calculation
+ * of Quantiles and Histograms Without Storing Observations").
+ */
+typedef struct {
+    double p;     /* quantile to estimate, in (0, 1) */
+    double q[5];  /* marker heights */
+    double n[5];  /* marker positions */
+    double np[5]; /* desired marker positions */
+    double dn[5]; /* increments of the desired positions */
+    int count;
+} p2_t;
+
+void p2_init(p2_t *est, double p);
+void p2_push(p2_t *est, double x);
+double p2_value(const p2_t *est);
+
+#endif
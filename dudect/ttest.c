@@ -27,6 +27,24 @@ void t_push(t_context_t *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Combine the statistics of src into dst, as if all values pushed to src
+ * had been pushed to dst (Chan et al., "Updating Formulae and a Pairwise
+ * Algorithm for Computing Sample Variances").
+ */
+void t_merge(t_context_t *dst, const t_context_t *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = dst->n[class] + src->n[class];
+        if (n == 0)
+            continue;
+        double delta = src->mean[class] - dst->mean[class];
+        dst->mean[class] += delta * src->n[class] / n;
+        dst->m2[class] += src->m2[class] +
+                          delta * delta * dst->n[class] * src->n[class] / n;
+        dst->n[class] = n;
+    }
+}
+
 double t_compute(t_context_t *ctx)
 {
     double var[2] = {0.0, 0.0};
@@ -0,0 +1,220 @@
+/* Epoch-based reclamation
+ *
+ * A global epoch only moves on once every reader in a section has seen the
+ * current one. Objects retired in epoch e were unlinked before any reader
+ * that starts in e + 1, so by epoch e + 2 no reader can hold them. Each
+ * thread keeps what it retired in one bucket per epoch, three of them in
+ * turn, and releases a bucket when it comes round again or is old enough.
+ *
+ * Every thread owns a record, found again through a thread-local pointer,
+ * and returns it when it exits. Records are never freed, so that the list
+ * can be walked without locks; a returned record, and anything still
+ * retired in it, is taken by the next thread that needs one.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "report.h"
+
+#define EPOCH_BUCKETS 3
+
+/* Objects a thread retires between attempts to move the epoch on */
+#define EPOCH_POLL 64
+
+typedef struct {
+    void *p;
+    epoch_release_t release;
+} garbage_t;
+
+typedef struct {
+    garbage_t *item;
+    size_t n, cap;
+    uint64_t epoch; /* Epoch the items were retired in */
+} limbo_t;
+
+typedef struct epoch_record {
+    _Atomic uint64_t state; /* Epoch seen << 1, | 1 while in a section */
+    atomic_bool owned;      /* Owned by a thread */
+    struct epoch_record *next;
+    unsigned nest; /* Depth of sections */
+    unsigned since_poll;
+    limbo_t limbo[EPOCH_BUCKETS];
+    _Atomic uint64_t retired, freed;
+} epoch_record_t;
+
+static _Atomic uint64_t global_epoch = 0;
+static _Atomic(epoch_record_t *) records = NULL;
+static __thread epoch_record_t *self = NULL;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+/* Return the record of a thread as it exits */
+static void epoch_release(void *p)
+{
+    epoch_record_t *rec = p;
+    rec->nest = 0;
+    atomic_store(&rec->state, 0);
+    atomic_store(&rec->owned, false);
+}
+
+static void epoch_key_init(void)
+{
+    pthread_key_create(&epoch_key, epoch_release);
+}
+
+static epoch_record_t *epoch_acquire(void)
+{
+    if (self)
+        return self;
+
+    pthread_once(&epoch_key_once, epoch_key_init);
+    epoch_record_t *rec;
+    for (rec = atomic_load(&records); rec; rec = rec->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&rec->owned, &expected, true))
+            break;
+    }
+    if (!rec) {
+        rec = calloc(1, sizeof(epoch_record_t));
+        if (!rec)
+            report_event(MSG_FATAL, "Couldn't allocate epoch record");
+        atomic_init(&rec->state, 0);
+        atomic_init(&rec->owned, true);
+        atomic_init(&rec->retired, 0);
+        atomic_init(&rec->freed, 0);
+        epoch_record_t *head = atomic_load(&records);
+        do {
+            rec->next = head;
+        } while (!atomic_compare_exchange_weak(&records, &head, rec));
+    }
+
+    pthread_setspecific(epoch_key, rec);
+    self = rec;
+    return rec;
+}
+
+void epoch_enter(void)
+{
+    epoch_record_t *rec = epoch_acquire();
+    if (rec->nest++)
+        return;
+    uint64_t e = atomic_load(&global_epoch);
+    atomic_store(&rec->state, e << 1 | 1);
+    /* Shared pointers must be read after the epoch is published */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void)
+{
+    epoch_record_t *rec = self;
+    if (--rec->nest)
+        return;
+    atomic_store_explicit(&rec->state, 0, memory_order_release);
+}
+
+/* Move the global epoch on if every reader in a section has seen it, and
+ * return the epoch
+ */
+static uint64_t try_advance(void)
+{
+    uint64_t e = atomic_load(&global_epoch);
+    for (epoch_record_t *r = atomic_load(&records); r; r = r->next) {
+        uint64_t s = atomic_load(&r->state);
+        if ((s & 1) && s >> 1 != e)
+            return e;
+    }
+    if (atomic_compare_exchange_strong(&global_epoch, &e, e + 1))
+        return e + 1;
+    return e;
+}
+
+/* Counters have a single writer, so no read-modify-write is needed */
+static void count(_Atomic uint64_t *counter, uint64_t n)
+{
+    uint64_t v = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, v + n, memory_order_relaxed);
+}
+
+static void free_bucket(epoch_record_t *rec, limbo_t *b)
+{
+    for (size_t i = 0; i < b->n; i++)
+        b->item[i].release(b->item[i].p);
+    count(&rec->freed, b->n);
+    b->n = 0;
+}
+
+/* Release the buckets of rec old enough at epoch e. Return whether any
+ * object is left.
+ */
+static bool collect(epoch_record_t *rec, uint64_t e)
+{
+    bool left = false;
+    for (int i = 0; i < EPOCH_BUCKETS; i++) {
+        limbo_t *b = &rec->limbo[i];
+        if (b->n && b->epoch + 2 <= e)
+            free_bucket(rec, b);
+        left |= b->n != 0;
+    }
+    return left;
+}
+
+void epoch_retire(void *p, epoch_release_t release)
+{
+    epoch_record_t *rec = epoch_acquire();
+    uint64_t e = atomic_load(&global_epoch);
+    limbo_t *b = &rec->limbo[e % EPOCH_BUCKETS];
+
+    /* A bucket holding an earlier epoch holds one at least three back */
+    if (b->n && b->epoch != e)
+        free_bucket(rec, b);
+    b->epoch = e;
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? 2 * b->cap : EPOCH_POLL;
+        garbage_t *item = realloc(b->item, cap * sizeof(garbage_t));
+        if (!item)
+            report_event(MSG_FATAL, "Couldn't allocate retired objects");
+        b->item = item;
+        b->cap = cap;
+    }
+    b->item[b->n++] = (garbage_t){p, release};
+    count(&rec->retired, 1);
+
+    if (++rec->since_poll >= EPOCH_POLL) {
+        rec->since_poll = 0;
+        collect(rec, try_advance());
+    }
+}
+
+void epoch_drain(void)
+{
+    epoch_record_t *rec = epoch_acquire();
+    while (1) {
+        uint64_t e = try_advance();
+        bool left = collect(rec, e);
+        for (epoch_record_t *r = atomic_load(&records); r; r = r->next) {
+            bool expected = false;
+            if (atomic_compare_exchange_strong(&r->owned, &expected, true)) {
+                left |= collect(r, e);
+                atomic_store(&r->owned, false);
+            }
+        }
+        if (!left)
+            break;
+        sched_yield();
+    }
+}
+
+void epoch_stats(epoch_stats_t *st)
+{
+    st->epoch = atomic_load(&global_epoch);
+    st->retired = st->freed = 0;
+    for (epoch_record_t *r = atomic_load(&records); r; r = r->next) {
+        st->retired += atomic_load_explicit(&r->retired, memory_order_relaxed);
+        st->freed += atomic_load_explicit(&r->freed, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef LAB0_EPOCH_H
+#define LAB0_EPOCH_H
+
+#include <stdint.h>
+
+/* Epoch-based reclamation, after Fraser, "Practical lock-freedom" (2004).
+ *
+ * Readers of a shared structure bracket every access with epoch_enter() and
+ * epoch_exit(). A writer that unlinks an object hands it to epoch_retire()
+ * instead of freeing it, and it is released once every reader that might
+ * still hold it has left. Readers only write a word of their own, and
+ * sections may nest.
+ *
+ * Objects are released by the thread that retired them, in later calls of
+ * epoch_retire() or in epoch_drain(). Only epoch_drain() also releases what
+ * threads left behind when they exited. So memory from the harness
+ * allocator, which must be freed by the thread that allocated it, may be
+ * retired by that thread as long as it does not exit first.
+ */
+
+typedef void (*epoch_release_t)(void *p);
+
+/* Enter and leave a read-side critical section */
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* Call release(p) once no reader can hold p any more */
+void epoch_retire(void *p, epoch_release_t release);
+
+/* Release everything retired by this thread, and by threads that have
+ * exited, waiting for readers to leave their sections as needed.
+ */
+void epoch_drain(void);
+
+typedef struct {
+    uint64_t epoch;   /* Current global epoch */
+    uint64_t retired; /* Objects handed to epoch_retire() */
+    uint64_t freed;   /* Objects released since */
+} epoch_stats_t;
+
+/* Counters over all threads. Objects pending are retired - freed */
+void epoch_stats(epoch_stats_t *st);
+
+#endif /* LAB0_EPOCH_H */
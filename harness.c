@@ -1,7 +1,9 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,19 +32,37 @@
 
 /* Data structures used by our code */
 
+/* Each thread keeps the blocks it allocated on a list of its own, so that
+ * threads measuring queue operations concurrently (see dudect) need no
+ * locking. A block must be freed by the thread that allocated it; one freed
+ * by another thread is reported and left allocated. The list of a thread
+ * that exits is handed over to the next thread that starts allocating, so
+ * blocks it leaked are still accounted for.
+ */
+typedef struct __arena {
+    struct __block_element *allocated;
+    struct __arena *next_free;
+} arena_t;
+
 /* Represent allocated blocks as doubly-linked list, with
  * next and prev pointers at beginning
  */
 typedef struct __block_element {
     struct __block_element *next, *prev;
+    arena_t *arena; /* List the block is linked on */
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+static __thread arena_t *arena = NULL;
+static arena_t *free_arenas = NULL;
+static pthread_mutex_t free_arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_size_t allocated_count = 0;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
@@ -67,6 +87,45 @@ typedef enum {
 
 /* Internal functions */
 
+/* Thread exit: make the list available to other threads */
+static void arena_release(void *p)
+{
+    arena_t *a = p;
+    pthread_mutex_lock(&free_arenas_lock);
+    a->next_free = free_arenas;
+    free_arenas = a;
+    pthread_mutex_unlock(&free_arenas_lock);
+}
+
+static void arena_key_init(void)
+{
+    pthread_key_create(&arena_key, arena_release);
+}
+
+static arena_t *get_arena(void)
+{
+    if (arena)
+        return arena;
+
+    pthread_once(&arena_key_once, arena_key_init);
+    pthread_mutex_lock(&free_arenas_lock);
+    arena_t *a = free_arenas;
+    if (a)
+        free_arenas = a->next_free;
+    pthread_mutex_unlock(&free_arenas_lock);
+
+    if (!a) {
+        a = calloc(1, sizeof(arena_t));
+        if (!a) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            return NULL;
+        }
+    }
+    pthread_setspecific(arena_key, a);
+    arena = a;
+    return a;
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
@@ -88,7 +147,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
+        block_element_t *ab = get_arena()->allocated;
         bool found = false;
         while (ab && !found) {
             found = ab == b;
@@ -156,14 +215,17 @@ static void *alloc(alloc_t alloc_type, size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
+    arena_t *a = get_arena();
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->arena = a;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->next = a->allocated;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
+    if (a->allocated)
+        a->allocated->prev = new_block;
+    a->allocated = new_block;
     allocated_count++;
 
     return p;
@@ -198,6 +260,16 @@ void test_free(void *p)
         return;
 
     block_element_t *b = find_header(p);
+    if (b->arena != get_arena()) {
+        /* Its list belongs to another thread, so leave the block on it */
+        report_event(MSG_ERROR,
+                     "Block with address %p freed by a thread other than the "
+                     "one that allocated it",
+                     p);
+        error_occurred = true;
+        return;
+    }
+
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -216,7 +288,7 @@ void test_free(void *p)
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        b->arena->allocated = bn;
     if (bn)
         bn->prev = bp;
 
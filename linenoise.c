@@ -105,7 +105,9 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -132,9 +134,28 @@ static bool rawmode =
     false; /* For atexit() function to check if restore is needed*/
 static bool mlmode = false; /* Multi line mode. Default is single line. */
 static bool atexit_registered = false; /* Register atexit just 1 time. */
+static bool pasting = false; /* Inside a bracketed paste, see paste_line() */
+static size_t last_cols = 80; /* Columns found for the previous line */
+
+/* Input is read from the terminal in chunks and handed out a character at a
+ * time, so that pasted text does not take a read() per character. Whatever
+ * is left when a line ends is kept for the next one.
+ */
+static char inbuf[4096];
+static size_t inbuf_pos = 0, inbuf_len = 0;
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
 static int history_len = 0;
+static int history_start = 0; /* Slot of the oldest entry in the ring */
 static char **history = NULL;
+/* Entries are numbered in the order they were added, for the search index.
+ * The oldest entry in the ring has number history_first_seq.
+ */
+static uint32_t history_first_seq = 0;
+
+/* Append-only history file, see line_history_journal() */
+static int journal_fd = -1;
+static char *journal_name = NULL;
+static int journal_lines = 0; /* Lines in the file */
 
 /* The line_state structure represents the state during line editing.
  * We pass this state to functions implementing specific editing
@@ -153,6 +174,14 @@ struct line_state {
     size_t cols;        /* Number of columns in terminal. */
     size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
     int history_index;  /* The history index we are currently editing. */
+    bool dirty;         /* Buffer changed since the last refresh. */
+    /* What the terminal shows after the prompt in single line mode, so that
+     * refresh_single_line() only rewrites what changed.
+     */
+    bool shown_valid;                /* False forces a full refresh. */
+    size_t shown_len;                /* Characters shown. */
+    size_t shown_col;                /* Cursor column. */
+    char shown[LINENOISE_MAX_LINE]; /* Characters shown. */
 };
 
 enum KEY_ACTION {
@@ -163,6 +192,7 @@ enum KEY_ACTION {
     CTRL_D = 4,     /* Ctrl-d */
     CTRL_E = 5,     /* Ctrl-e */
     CTRL_F = 6,     /* Ctrl-f */
+    CTRL_G = 7,     /* Ctrl-g */
     CTRL_H = 8,     /* Ctrl-h */
     TAB = 9,        /* Tab */
     CTRL_K = 11,    /* Ctrl+k */
@@ -170,6 +200,7 @@ enum KEY_ACTION {
     ENTER = 13,     /* Enter */
     CTRL_N = 14,    /* Ctrl-n */
     CTRL_P = 16,    /* Ctrl-p */
+    CTRL_R = 18,    /* Ctrl-r */
     CTRL_T = 20,    /* Ctrl-t */
     CTRL_U = 21,    /* Ctrl+u */
     CTRL_W = 23,    /* Ctrl+w */
@@ -178,7 +209,10 @@ enum KEY_ACTION {
 };
 
 static void line_atexit(void);
-int line_history_add(const char *line);
+static char **history_at(int index);
+static int history_push(const char *line);
+static void history_pop(void);
+static int history_search(const char *query, int before);
 static void refresh_line(struct line_state *l);
 
 /* Debugging macro. */
@@ -267,10 +301,16 @@ static int enable_raw_mode(int fd)
     raw.c_cc[VMIN] = 1;
     raw.c_cc[VTIME] = 0; /* 1 byte, no timer */
 
-    /* put terminal in raw mode after flushing */
-    if (tcsetattr(fd, TCSAFLUSH, &raw) < 0)
+    /* put terminal in raw mode once output is written. Unread input is kept,
+     * as it may be the rest of a paste.
+     */
+    if (tcsetattr(fd, TCSADRAIN, &raw) < 0)
         goto fatal;
     rawmode = true;
+    /* Have the terminal bracket pasted text with ESC [200~ and ESC [201~ */
+    if (write(STDOUT_FILENO, "\x1b[?2004h", 8) != 8) {
+        /* Pasting works without it, only slower. */
+    }
     return 0;
 
 fatal:
@@ -280,11 +320,35 @@ fatal:
 
 static void disable_raw_mode(int fd)
 {
-    /* Don't even check the return value as it's too late. */
-    if (rawmode && tcsetattr(fd, TCSAFLUSH, &orig_termios) != -1)
+    /* Don't even check the return values as it's too late. */
+    if (rawmode && write(STDOUT_FILENO, "\x1b[?2004l", 8) != 8) {
+    }
+    if (rawmode && tcsetattr(fd, TCSADRAIN, &orig_termios) != -1)
         rawmode = false;
 }
 
+/* Read one character of input. Returns 1 on success, 0 at the end of input
+ * and -1 on errors, as read() does.
+ */
+static int line_read(int fd, char *c)
+{
+    if (inbuf_pos == inbuf_len) {
+        ssize_t n = read(fd, inbuf, sizeof(inbuf));
+        if (n <= 0)
+            return n;
+        inbuf_pos = 0;
+        inbuf_len = n;
+    }
+    *c = inbuf[inbuf_pos++];
+    return 1;
+}
+
+/* Whether input has been read that is not handled yet */
+static bool line_read_pending(void)
+{
+    return inbuf_pos < inbuf_len;
+}
+
 /* Use the ESC [6n escape sequence to query the horizontal cursor position
  * and return it. On error -1 is returned, on success the position of the
  * cursor.
@@ -417,7 +481,7 @@ static int complete_line(struct line_state *ls)
                 refresh_line(ls);
             }
 
-            int nread = read(ls->ifd, &c, 1);
+            int nread = line_read(ls->ifd, &c);
             if (nread <= 0) {
                 free_completions(&lc);
                 return -1;
@@ -510,36 +574,52 @@ void line_add_completion(line_completions_t *lc, const char *str)
 
 /* =========================== Line editing ================================= */
 
-/* We define a very simple "append buffer" structure, that is an heap
- * allocated string where we can append to. This is useful in order to
- * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects.
+/* We define a very simple "append buffer" structure, that is a fixed buffer
+ * we can append to. This is useful in order to write all the escape
+ * sequences in a buffer and flush them to the standard output in a single
+ * call, to avoid flickering effects. Only a refresh larger than the buffer
+ * is written in several calls.
  */
+#define AB_SIZE 4096
+
 struct abuf {
-    char *b;
+    int fd;
     int len;
+    char b[AB_SIZE];
 };
 
-static void ab_init(struct abuf *ab)
+static void ab_init(struct abuf *ab, int fd)
 {
-    ab->b = NULL;
+    ab->fd = fd;
     ab->len = 0;
 }
 
-static void ab_append(struct abuf *ab, const char *s, int len)
+static void ab_flush(struct abuf *ab)
 {
-    char *new = realloc(ab->b, ab->len + len);
-    if (!new)
-        return;
+    if (ab->len && write(ab->fd, ab->b, ab->len) == -1) {
+    } /* Can't recover from write error. */
+    ab->len = 0;
+}
 
-    memcpy(new + ab->len, s, len);
-    ab->b = new;
-    ab->len += len;
+static void ab_append(struct abuf *ab, const char *s, int len)
+{
+    while (len > 0) {
+        if (ab->len == AB_SIZE)
+            ab_flush(ab);
+        int n = AB_SIZE - ab->len < len ? AB_SIZE - ab->len : len;
+        memcpy(ab->b + ab->len, s, n);
+        ab->len += n;
+        s += n;
+        len -= n;
+    }
 }
 
-static inline void ab_free(struct abuf *ab)
+/* Move the cursor to column col of the current row */
+static void ab_move_to(struct abuf *ab, size_t col)
 {
-    free(ab->b);
+    char seq[64];
+    snprintf(seq, 64, "\r\x1b[%dC", (int) col);
+    ab_append(ab, seq, strlen(seq));
 }
 
 /* Helper of refresh_single_line() and refresh_multi_Line() to show hints
@@ -576,13 +656,16 @@ void refresh_show_hints(struct abuf *ab, struct line_state *l, int plen)
 /* Single line low level line refresh.
  *
  * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal.
+ * cursor position, and number of columns of the terminal. Only the
+ * characters from the first one that differs from what the terminal shows
+ * are written, or just a cursor move when none does. Hints are always
+ * redrawn in full.
  */
 static void refresh_single_line(struct line_state *l)
 {
     char seq[64];
+    char mask[LINENOISE_MAX_LINE];
     size_t plen = strlen(l->prompt);
-    int fd = l->ofd;
     char *buf = l->buf;
     size_t len = l->len;
     size_t pos = l->pos;
@@ -596,29 +679,50 @@ static void refresh_single_line(struct line_state *l)
     while (plen + len > l->cols)
         len--;
 
-    ab_init(&ab);
-    /* Cursor to left edge */
-    snprintf(seq, 64, "\r");
-    ab_append(&ab, seq, strlen(seq));
-    /* Write the prompt and the current buffer content */
-    ab_append(&ab, l->prompt, strlen(l->prompt));
     if (maskmode) {
-        while (len--)
-            ab_append(&ab, "*", 1);
-    } else {
+        memset(mask, '*', len);
+        buf = mask;
+    }
+
+    ab_init(&ab, l->ofd);
+    if (!l->shown_valid || hints_callback) {
+        /* Cursor to left edge */
+        snprintf(seq, 64, "\r");
+        ab_append(&ab, seq, strlen(seq));
+        /* Write the prompt and the current buffer content */
+        ab_append(&ab, l->prompt, strlen(l->prompt));
         ab_append(&ab, buf, len);
+        /* Show hits if any. */
+        refresh_show_hints(&ab, l, plen);
+        /* Erase to right */
+        snprintf(seq, 64, "\x1b[0K");
+        ab_append(&ab, seq, strlen(seq));
+        /* Move cursor to original position. */
+        ab_move_to(&ab, pos + plen);
+    } else {
+        size_t same = 0;
+        while (same < len && same < l->shown_len && buf[same] == l->shown[same])
+            same++;
+        size_t col = l->shown_col;
+        if (same < len || same < l->shown_len) {
+            ab_move_to(&ab, plen + same);
+            ab_append(&ab, buf + same, len - same);
+            if (len < l->shown_len) {
+                snprintf(seq, 64, "\x1b[0K");
+                ab_append(&ab, seq, strlen(seq));
+            }
+            col = plen + len;
+        }
+        /* Move cursor to original position. */
+        if (col != plen + pos)
+            ab_move_to(&ab, plen + pos);
     }
-    /* Show hits if any. */
-    refresh_show_hints(&ab, l, plen);
-    /* Erase to right */
-    snprintf(seq, 64, "\x1b[0K");
-    ab_append(&ab, seq, strlen(seq));
-    /* Move cursor to original position. */
-    snprintf(seq, 64, "\r\x1b[%dC", (int) (pos + plen));
-    ab_append(&ab, seq, strlen(seq));
-    if (write(fd, ab.b, ab.len) == -1) {
-    } /* Can't recover from write error. */
-    ab_free(&ab);
+    ab_flush(&ab);
+
+    memcpy(l->shown, buf, len);
+    l->shown_len = len;
+    l->shown_col = plen + pos;
+    l->shown_valid = true;
 }
 
 /* Multi line low level line refresh.
@@ -637,7 +741,6 @@ static void refresh_multi_Line(struct line_state *l)
     int rpos2;                                  /* rpos after refresh. */
     int col; /* colum position, zero-based. */
     int old_rows = l->maxrows;
-    int fd = l->ofd;
     struct abuf ab;
 
     /* Update maxrows if needed. */
@@ -646,7 +749,7 @@ static void refresh_multi_Line(struct line_state *l)
 
     /* First step: clear all the lines used before. To do so start by
      * going to the last row. */
-    ab_init(&ab);
+    ab_init(&ab, l->ofd);
     if (old_rows - rpos > 0) {
         lndebug("go down %d", old_rows - rpos);
         snprintf(seq, 64, "\x1b[%dB", old_rows - rpos);
@@ -714,9 +817,7 @@ static void refresh_multi_Line(struct line_state *l)
     lndebug("\n");
     l->oldpos = l->pos;
 
-    if (write(fd, ab.b, ab.len) == -1) {
-    } /* Can't recover from write error. */
-    ab_free(&ab);
+    ab_flush(&ab);
 }
 
 /* Calls the two low level functions refresh_single_line() or
@@ -724,12 +825,168 @@ static void refresh_multi_Line(struct line_state *l)
  */
 static void refresh_line(struct line_state *l)
 {
+    l->dirty = false;
     if (mlmode)
         refresh_multi_Line(l);
     else
         refresh_single_line(l);
 }
 
+/* Show the reverse incremental search prompt, the query and its match in
+ * place of the edited line.
+ */
+static void refresh_search(struct line_state *l,
+                           const char *query,
+                           int match,
+                           bool failed)
+{
+    char line[LINENOISE_MAX_LINE];
+    struct abuf ab;
+
+    int len = snprintf(line, sizeof(line), "%s(reverse-i-search)`%s': %s",
+                       failed ? "failing " : "", query,
+                       match >= 0 ? *history_at(match) : "");
+    if (len < 0)
+        return;
+    if (len > (int) sizeof(line) - 1)
+        len = sizeof(line) - 1;
+    if (len > (int) l->cols - 1)
+        len = l->cols - 1;
+
+    ab_init(&ab, l->ofd);
+    ab_append(&ab, "\r", 1);
+    ab_append(&ab, line, len);
+    ab_append(&ab, "\x1b[0K", 4);
+    ab_flush(&ab);
+    l->shown_valid = false;
+}
+
+/* This is an helper function for line_edit() and is called when the user
+ * types Ctrl-R, to search the history backwards for the typed text.
+ *
+ * Every character typed extends the query, which is searched from the
+ * current match on. Ctrl-R again moves to the next older match, Ctrl-G
+ * gives up and restores the edited line. Any other key takes the match
+ * into the edited line and is returned to be handled as usual, so Enter
+ * runs it right away.
+ */
+static int search_line(struct line_state *l)
+{
+    char query[LINENOISE_MAX_LINE];
+    size_t qlen = 0;
+    /* The newest entry is the line being edited */
+    const int newest = history_len - 1;
+    int match = -1;
+    bool failed = false;
+    char c;
+
+    query[0] = '\0';
+    while (1) {
+        refresh_search(l, query, match, failed);
+        if (line_read(l->ifd, &c) <= 0)
+            return -1;
+
+        int from = -1;
+        if (c == CTRL_R) {
+            from = match >= 0 ? match : newest;
+        } else if (c == BACKSPACE || c == CTRL_H) {
+            if (qlen)
+                query[--qlen] = '\0';
+            from = newest;
+        } else if (c == CTRL_G || c == CTRL_C) {
+            refresh_line(l);
+            return 0;
+        } else if ((unsigned char) c >= ' ' && qlen < sizeof(query) - 1) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            from = match >= 0 ? match + 1 : newest;
+        } else {
+            if (match >= 0) {
+                int n = snprintf(l->buf, l->buflen, "%s", *history_at(match));
+                l->len = l->pos = n < (int) l->buflen ? n : l->buflen - 1;
+            }
+            refresh_line(l);
+            return c;
+        }
+
+        if (!qlen) {
+            match = -1;
+            failed = false;
+            continue;
+        }
+        int found = history_search(query, from);
+        failed = found < 0;
+        if (!failed)
+            match = found;
+    }
+}
+
+/* Insert the character 'c' at cursor current position, leaving the refresh
+ * for later.
+ */
+static void line_insert_quiet(struct line_state *l, char c)
+{
+    if (l->len < l->buflen) {
+        memmove(l->buf + l->pos + 1, l->buf + l->pos, l->len - l->pos);
+        l->buf[l->pos] = c;
+        l->len++;
+        l->pos++;
+        l->buf[l->len] = '\0';
+        l->dirty = true;
+    }
+}
+
+/* Take pasted text into the edited line, up to the end of a line or of the
+ * paste. The terminal brackets the paste, so none of it is taken as an
+ * editing key, and the line is drawn once rather than once per character.
+ *
+ * Returns ENTER at the end of a line, for the caller to return it as typed,
+ * 0 at the end of the paste and -1 on errors. A paste of several lines goes
+ * on in the following calls of line_edit().
+ */
+static int paste_line(struct line_state *l)
+{
+    static const char end[] = "\x1b[201~";
+    char c;
+
+    while (1) {
+        if (line_read(l->ifd, &c) <= 0)
+            return -1;
+
+        while (c == ESC) {
+            size_t i = 1;
+            while (1) {
+                if (line_read(l->ifd, &c) <= 0)
+                    return -1;
+                if (c != end[i])
+                    break;
+                if (++i == sizeof(end) - 1) {
+                    pasting = false;
+                    refresh_line(l);
+                    return 0;
+                }
+            }
+            /* Not the end of the paste: keep what matched, and go on with
+             * the character that did not, like any other. ESC itself is a
+             * control character, dropped.
+             */
+            for (size_t j = 1; j < i; j++)
+                line_insert_quiet(l, end[j]);
+        }
+
+        if (c == '\r' || c == '\n') {
+            /* Take CR LF as one line end */
+            if (c == '\r' && line_read_pending() && inbuf[inbuf_pos] == '\n')
+                inbuf_pos++;
+            refresh_line(l);
+            return ENTER;
+        }
+
+        if ((unsigned char) c >= ' ')
+            line_insert_quiet(l, c);
+    }
+}
+
 /* Insert the character 'c' at cursor current position.
  *
  * On error writing to the terminal -1 is returned, otherwise 0.
@@ -742,12 +999,15 @@ int line_edit_insert(struct line_state *l, char c)
             l->pos++;
             l->len++;
             l->buf[l->len] = '\0';
-            if ((!mlmode && l->plen + l->len < l->cols && !hints_callback)) {
+            if (!mlmode && l->plen + l->len < l->cols && !hints_callback &&
+                !l->dirty) {
                 /* Avoid a full update of the line in the
                  * trivial case. */
                 char d = maskmode ? '*' : c;
                 if (write(l->ofd, &d, 1) == -1)
                     return -1;
+                l->shown[l->shown_len++] = d;
+                l->shown_col++;
             } else {
                 refresh_line(l);
             }
@@ -808,8 +1068,9 @@ void line_edit_history_next(struct line_state *l, int dir)
     if (history_len > 1) {
         /* Update the current history entry before to
          * overwrite it with the next one. */
-        free(history[history_len - 1 - l->history_index]);
-        history[history_len - 1 - l->history_index] = strdup(l->buf);
+        char **entry = history_at(history_len - 1 - l->history_index);
+        free(*entry);
+        *entry = strdup(l->buf);
         /* Show the new entry */
         l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
         if (l->history_index < 0) {
@@ -819,7 +1080,8 @@ void line_edit_history_next(struct line_state *l, int dir)
             l->history_index = history_len - 1;
             return;
         }
-        strncpy(l->buf, history[history_len - 1 - l->history_index], l->buflen);
+        strncpy(l->buf, *history_at(history_len - 1 - l->history_index),
+                l->buflen);
         l->buf[l->buflen - 1] = '\0';
         l->len = l->pos = strlen(l->buf);
         refresh_line(l);
@@ -927,9 +1189,17 @@ static int line_edit(int stdin_fd,
     l.plen = strlen(prompt);
     l.oldpos = l.pos = 0;
     l.len = 0;
-    l.cols = get_columns(stdin_fd, stdout_fd);
+    /* Querying the terminal would read input already waiting */
+    if (!pasting && !line_read_pending())
+        last_cols = get_columns(stdin_fd, stdout_fd);
+    l.cols = last_cols;
     l.maxrows = 0;
     l.history_index = 0;
+    l.dirty = false;
+    /* Just the prompt is shown, written below */
+    l.shown_valid = true;
+    l.shown_len = 0;
+    l.shown_col = l.plen;
 
     /* Buffer starts empty. */
     l.buf[0] = '\0';
@@ -938,7 +1208,7 @@ static int line_edit(int stdin_fd,
     /* The latest history entry is always our current buffer, that
      * initially is just an empty string.
      */
-    line_history_add("");
+    history_push("");
 
     if (write(l.ofd, prompt, l.plen) == -1)
         return -1;
@@ -947,20 +1217,45 @@ static int line_edit(int stdin_fd,
         int nread;
         char seq[5];
 
-        if (eventmux_callback != NULL) {
-            int result = eventmux_callback(l.buf);
-            if (result != 0)
-                return result;
-        }
+        if (pasting) {
+            c = paste_line(&l);
+            if (c < 0)
+                return l.len;
+            if (c == 0)
+                continue;
+        } else {
+            /* Characters inserted while more input was waiting are drawn
+             * once it has all been handled
+             */
+            if (l.dirty && !line_read_pending())
+                refresh_line(&l);
+
+            if (eventmux_callback != NULL && !line_read_pending()) {
+                int result = eventmux_callback(l.buf);
+                if (result != 0)
+                    return result;
+            }
 
-        nread = read(l.ifd, &c, 1);
-        if (nread <= 0)
-            return l.len;
+            nread = line_read(l.ifd, (char *) &c);
+            if (nread <= 0)
+                return l.len;
+        }
 
         /* Only autocomplete when the callback is set. It returns < 0 when
          * there was an error reading from fd. Otherwise it will return the
          * character that should be handled next.
          */
+        /* Ctrl-R searches the history. It returns the character to handle
+         * next, as completion does.
+         */
+        if (c == CTRL_R) {
+            c = search_line(&l);
+            if (c < 0)
+                return l.len;
+            if (c == 0)
+                continue;
+        }
+
         if (c == 9 && completion_callback != NULL) {
             c = complete_line(&l);
             /* Return on errors */
@@ -973,8 +1268,9 @@ static int line_edit(int stdin_fd,
 
         switch (c) {
         case ENTER: /* enter */
-            history_len--;
-            free(history[history_len]);
+            history_pop();
+            if (l.dirty)
+                refresh_line(&l);
             if (mlmode)
                 line_edit_move_end(&l);
             if (hints_callback) {
@@ -1000,8 +1296,7 @@ static int line_edit(int stdin_fd,
             if (l.len > 0) {
                 line_edit_delete(&l);
             } else {
-                history_len--;
-                free(history[history_len]);
+                history_pop();
                 return -1;
             }
             break;
@@ -1032,16 +1327,16 @@ static int line_edit(int stdin_fd,
              * Use two calls to handle slow terminals returning the two
              * chars at different times.
              */
-            if (read(l.ifd, seq, 1) == -1)
+            if (line_read(l.ifd, seq) == -1)
                 break;
-            if (read(l.ifd, seq + 1, 1) == -1)
+            if (line_read(l.ifd, seq + 1) == -1)
                 break;
 
             /* ESC [ sequences. */
             if (seq[0] == '[') {
                 if (seq[1] >= '0' && seq[1] <= '9') {
                     /* Extended escape, read additional byte. */
-                    if (read(l.ifd, seq + 2, 1) == -1)
+                    if (line_read(l.ifd, seq + 2) == -1)
                         break;
                     switch (seq[2]) {
                     case '~':
@@ -1052,11 +1347,25 @@ static int line_edit(int stdin_fd,
                         }
                         break;
 
+                    case '0':
+                        /* Bracketed paste starts with ESC [200~, while F9
+                         * is ESC [20~ and ends one byte earlier.
+                         */
+                        if (seq[1] != '2')
+                            break;
+                        if (line_read(l.ifd, seq + 3) == -1 || seq[3] != '0')
+                            break;
+                        if (line_read(l.ifd, seq + 4) == -1)
+                            break;
+                        if (seq[4] == '~')
+                            pasting = true;
+                        break;
+
                     case ';':
                         /* Even more extended escape, read additional 2 bytes */
-                        if (read(l.ifd, seq + 3, 1) == -1)
+                        if (line_read(l.ifd, seq + 3) == -1)
                             break;
-                        if (read(l.ifd, seq + 4, 1) == -1)
+                        if (line_read(l.ifd, seq + 4) == -1)
                             break;
                         if (seq[3] == '5') {
                             switch (seq[4]) {
@@ -1107,6 +1416,13 @@ static int line_edit(int stdin_fd,
             }
             break;
         default:
+            /* More input is already waiting, as when pasting into a
+             * terminal without bracketed paste
+             */
+            if (line_read_pending() && (unsigned char) c >= ' ') {
+                line_insert_quiet(&l, c);
+                break;
+            }
             if (line_edit_insert(&l, c))
                 return -1;
             break;
@@ -1128,6 +1444,7 @@ static int line_edit(int stdin_fd,
             break;
         case CTRL_L: /* ctrl+l, clear screen */
             line_clear_screen();
+            l.shown_valid = false;
             refresh_line(&l);
             break;
         case CTRL_W: /* ctrl+w, delete previous word */
@@ -1248,6 +1565,158 @@ void line_free(void *ptr)
 
 /* ================================ History ================================= */
 
+/* Slot of the index-th oldest entry. The history is a ring of
+ * history_max_len slots, so dropping the oldest entry moves nothing.
+ */
+static char **history_at(int index)
+{
+    return &history[(history_start + index) % history_max_len];
+}
+
+/* Trigram index for searching the history.
+ *
+ * For every three characters that appear together in some entry, a posting
+ * list holds the numbers of the entries they appear in, in ascending order.
+ * A query is only checked against the entries in the shortest list among its
+ * own trigrams, so searching stays fast however long the history grows.
+ * Entries dropped from the ring are skipped when met, and cleared from a list
+ * when it next needs to grow. Entries changed in place while browsing the
+ * history keep the trigrams they were added with, so a search may miss them.
+ */
+typedef struct {
+    uint32_t trigram; /* Three nonzero characters, 0 for a free slot */
+    uint32_t len, cap;
+    uint32_t *seq;
+} posting_t;
+
+static posting_t *trigrams = NULL;
+static uint32_t trigrams_cap = 0; /* Slots, a power of two */
+static uint32_t trigrams_used = 0;
+
+static uint32_t trigram_at(const char *s)
+{
+    return (uint32_t) (unsigned char) s[0] << 16 |
+           (uint32_t) (unsigned char) s[1] << 8 | (unsigned char) s[2];
+}
+
+/* Slot of trigram t in table, which has cap slots, either holding t or free */
+static posting_t *trigram_slot(posting_t *table, uint32_t cap, uint32_t t)
+{
+    uint32_t i = (t * 2654435761U) & (cap - 1);
+    while (table[i].trigram && table[i].trigram != t)
+        i = (i + 1) & (cap - 1);
+    return &table[i];
+}
+
+/* Keep the table at most half full */
+static bool trigrams_reserve(void)
+{
+    if (2 * (trigrams_used + 1) <= trigrams_cap)
+        return true;
+
+    uint32_t cap = trigrams_cap ? 2 * trigrams_cap : 1024;
+    posting_t *table = calloc(cap, sizeof(posting_t));
+    if (!table)
+        return false;
+    for (uint32_t i = 0; i < trigrams_cap; i++) {
+        if (trigrams[i].trigram)
+            *trigram_slot(table, cap, trigrams[i].trigram) = trigrams[i];
+    }
+    free(trigrams);
+    trigrams = table;
+    trigrams_cap = cap;
+    return true;
+}
+
+static void posting_add(posting_t *p, uint32_t seq)
+{
+    /* An entry is listed once however often the trigram appears in it */
+    if (p->len && p->seq[p->len - 1] >= seq)
+        return;
+
+    if (p->len == p->cap) {
+        /* Clear the entries dropped from the ring before growing */
+        uint32_t stale = 0;
+        while (stale < p->len && p->seq[stale] < history_first_seq)
+            stale++;
+        memmove(p->seq, p->seq + stale, (p->len - stale) * sizeof(uint32_t));
+        p->len -= stale;
+    }
+    if (p->len == p->cap) {
+        uint32_t cap = p->cap ? 2 * p->cap : 4;
+        uint32_t *new = realloc(p->seq, cap * sizeof(uint32_t));
+        if (!new)
+            return;
+        p->seq = new;
+        p->cap = cap;
+    }
+    p->seq[p->len++] = seq;
+}
+
+static void index_add(uint32_t seq, const char *line)
+{
+    size_t len = strlen(line);
+    for (size_t i = 0; i + 3 <= len; i++) {
+        if (!trigrams_reserve())
+            return;
+        uint32_t t = trigram_at(line + i);
+        posting_t *p = trigram_slot(trigrams, trigrams_cap, t);
+        if (!p->trigram) {
+            p->trigram = t;
+            trigrams_used++;
+        }
+        posting_add(p, seq);
+    }
+}
+
+static void index_free(void)
+{
+    for (uint32_t i = 0; i < trigrams_cap; i++)
+        free(trigrams[i].seq);
+    free(trigrams);
+    trigrams = NULL;
+    trigrams_cap = trigrams_used = 0;
+}
+
+/* Return the newest entry older than entry 'before' that contains query, or
+ * -1 if there is none. Entries are numbered from 0, the oldest.
+ */
+static int history_search(const char *query, int before)
+{
+    size_t qlen = strlen(query);
+    if (before > history_len)
+        before = history_len;
+
+    /* Too short for a trigram, so look at every entry */
+    if (qlen < 3 || !trigrams_cap) {
+        for (int i = before - 1; i >= 0; i--) {
+            if (strstr(*history_at(i), query))
+                return i;
+        }
+        return -1;
+    }
+
+    const posting_t *best = NULL;
+    for (size_t i = 0; i + 3 <= qlen; i++) {
+        const posting_t *p =
+            trigram_slot(trigrams, trigrams_cap, trigram_at(query + i));
+        if (!p->trigram)
+            return -1;
+        if (!best || p->len < best->len)
+            best = p;
+    }
+
+    for (uint32_t j = best->len; j > 0; j--) {
+        uint32_t seq = best->seq[j - 1];
+        if (seq < history_first_seq)
+            break;
+        int i = seq - history_first_seq;
+        if (i < before && strstr(*history_at(i), query))
+            return i;
+    }
+    return -1;
+}
+
 /* Free the history, but does not reset it. Only used when we have to
  * exit() to avoid memory leaks are reported by valgrind & co.
  */
@@ -1255,27 +1724,49 @@ static void free_history(void)
 {
     if (history) {
         for (int j = 0; j < history_len; j++)
-            free(history[j]);
+            free(*history_at(j));
         free(history);
     }
+    index_free();
+}
+
+/* Rewrite the journal with just the history kept in memory, once it holds
+ * more lines than that. The new file is written aside and renamed over the
+ * old one, so it is never left half written.
+ */
+static void journal_compact(void)
+{
+    if (journal_fd == -1)
+        return;
+    close(journal_fd);
+    journal_fd = -1;
+
+    if (journal_lines > history_len) {
+        size_t len = strlen(journal_name) + sizeof(".tmp");
+        char *tmp = malloc(len);
+        if (tmp) {
+            snprintf(tmp, len, "%s.tmp", journal_name);
+            if (line_history_save(tmp) == 0 && rename(tmp, journal_name))
+                unlink(tmp);
+            free(tmp);
+        }
+    }
+    free(journal_name);
+    journal_name = NULL;
 }
 
 /* At exit we'll try to fix the terminal to the initial conditions. */
 static void line_atexit(void)
 {
     disable_raw_mode(STDIN_FILENO);
+    journal_compact();
     free_history();
 }
 
-/* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
- *
- * Using a circular buffer is smarter, but a bit more complex to handle.
+/* Add a copy of line as the newest entry, dropping the oldest one when the
+ * history is full. Returns 1 when the line was added.
  */
-int line_history_add(const char *line)
+static int history_push(const char *line)
 {
     if (history_max_len == 0)
         return 0;
@@ -1286,10 +1777,11 @@ int line_history_add(const char *line)
         if (!history)
             return 0;
         memset(history, 0, (sizeof(char *) * history_max_len));
+        history_start = 0;
     }
 
     /* Don't add duplicated lines. */
-    if (history_len && !strcmp(history[history_len - 1], line))
+    if (history_len && !strcmp(*history_at(history_len - 1), line))
         return 0;
 
     /* Add an heap allocated copy of the line in the history.
@@ -1298,15 +1790,47 @@ int line_history_add(const char *line)
     if (!linecopy)
         return 0;
     if (history_len == history_max_len) {
-        free(history[0]);
-        memmove(history, history + 1, sizeof(char *) * (history_max_len - 1));
+        free(*history_at(0));
+        history_start = (history_start + 1) % history_max_len;
+        history_first_seq++;
         history_len--;
     }
-    history[history_len] = linecopy;
+    *history_at(history_len) = linecopy;
+    index_add(history_first_seq + history_len, linecopy);
     history_len++;
     return 1;
 }
 
+/* Drop the newest entry */
+static void history_pop(void)
+{
+    history_len--;
+    free(*history_at(history_len));
+}
+
+/* This is the API call to add a new entry in the linenoise history. When a
+ * journal is open, the entry is also appended to it.
+ */
+int line_history_add(const char *line)
+{
+    if (!history_push(line))
+        return 0;
+
+    if (journal_fd != -1) {
+        /* One write per line, so concurrent sessions never interleave */
+        size_t len = strlen(line);
+        char *buf = malloc(len + 1);
+        if (buf) {
+            memcpy(buf, line, len);
+            buf[len] = '\n';
+            if (write(journal_fd, buf, len + 1) == (ssize_t) (len + 1))
+                journal_lines++;
+            free(buf);
+        }
+    }
+    return 1;
+}
+
 /* Set the maximum length for the history. This function can be called even
  * if there is already some history, the function will make sure to retain
  * just the latest 'len' elements if the new history length value is smaller
@@ -1327,13 +1851,16 @@ int line_history_set_max_len(int len)
         /* If we can't copy everything, free the elements we'll not use. */
         if (len < tocopy) {
             for (int j = 0; j < tocopy - len; j++)
-                free(history[j]);
+                free(*history_at(j));
+            history_first_seq += tocopy - len;
             tocopy = len;
         }
         memset(new, 0, sizeof(char *) * len);
-        memcpy(new, history + (history_len - tocopy), sizeof(char *) * tocopy);
+        for (int j = 0; j < tocopy; j++)
+            new[j] = *history_at(history_len - tocopy + j);
         free(history);
         history = new;
+        history_start = 0;
     }
     history_max_len = len;
     if (history_len > history_max_len)
@@ -1355,11 +1882,28 @@ int line_history_save(const char *filename)
 
     chmod(filename, S_IRUSR | S_IWUSR);
     for (int j = 0; j < history_len; j++)
-        fprintf(fp, "%s\n", history[j]);
+        fprintf(fp, "%s\n", *history_at(j));
     fclose(fp);
     return 0;
 }
 
+/* Read lines from fp into the history. Return the number of lines read. */
+static int history_read(FILE *fp)
+{
+    int lines = 0;
+    char buf[LINENOISE_MAX_LINE];
+    while (fgets(buf, LINENOISE_MAX_LINE, fp) != NULL) {
+        char *p = strchr(buf, '\r');
+        if (!p)
+            p = strchr(buf, '\n');
+        if (p)
+            *p = '\0';
+        history_push(buf);
+        lines++;
+    }
+    return lines;
+}
+
 /* Load the history from the specified file. If the file does not exist
  * zero is returned and no operation is performed.
  *
@@ -1372,15 +1916,44 @@ int line_history_load(const char *filename)
     if (!fp)
         return -1;
 
-    char buf[LINENOISE_MAX_LINE];
-    while (fgets(buf, LINENOISE_MAX_LINE, fp) != NULL) {
-        char *p = strchr(buf, '\r');
-        if (!p)
-            p = strchr(buf, '\n');
-        if (p)
-            *p = '\0';
-        line_history_add(buf);
-    }
+    history_read(fp);
     fclose(fp);
     return 0;
 }
+
+/* Load the history from the specified file, then keep it open and append
+ * every line added with line_history_add() to it, rather than rewriting the
+ * whole file with line_history_save() after each one. Appends are not synced
+ * to disk. At exit the file is compacted down to the history kept in memory.
+ *
+ * On success 0 is returned, otherwise -1 is returned.
+ */
+int line_history_journal(const char *filename)
+{
+    if (journal_fd != -1)
+        return -1;
+
+    journal_lines = 0;
+    FILE *fp = fopen(filename, "r");
+    if (fp) {
+        journal_lines = history_read(fp);
+        fclose(fp);
+    }
+
+    journal_fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR);
+    if (journal_fd == -1)
+        return -1;
+    journal_name = strdup(filename);
+    if (!journal_name) {
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+
+    if (!atexit_registered) {
+        atexit(line_atexit);
+        atexit_registered = true;
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+/* Per-command hardware performance counters */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+#include "report.h"
+
+typedef struct {
+    char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+    uint64_t start[3]; /* Reading at perf_begin() */
+} perf_counter_t;
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES };
+
+#if defined(__linux__)
+static perf_counter_t counters[] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+                     -1, {0}},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS, -1, {0}},
+    [PERF_CACHE_MISSES] = {"cache-misses", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_CACHE_MISSES, -1, {0}},
+    [PERF_BRANCH_MISSES] = {"branch-misses", PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_BRANCH_MISSES, -1, {0}},
+};
+#define N_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+#endif
+
+static perf_scale_func_t scale_func = NULL;
+
+void perf_set_scale(perf_scale_func_t func)
+{
+    scale_func = func;
+}
+
+#if defined(__linux__)
+
+static int perf_event_open(struct perf_event_attr *attr)
+{
+    /* This thread, any CPU, no group */
+    return syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+/* Read a counter's value, time enabled and time running */
+static bool perf_read(const perf_counter_t *c, uint64_t buf[3])
+{
+    return read(c->fd, buf, 3 * sizeof(uint64_t)) == 3 * sizeof(uint64_t);
+}
+
+/* Count since start, scaled up if the kernel multiplexed the counter in
+ * between. Scaling each reading on its own could make the later one the
+ * smaller, so only the differences are scaled.
+ */
+static uint64_t perf_delta(const perf_counter_t *c)
+{
+    uint64_t buf[3];
+    if (!perf_read(c, buf) || buf[0] < c->start[0])
+        return 0;
+    uint64_t value = buf[0] - c->start[0];
+    uint64_t enabled = buf[1] - c->start[1];
+    uint64_t running = buf[2] - c->start[2];
+    if (running && running < enabled)
+        return (uint64_t) ((double) value * enabled / running);
+    return value;
+}
+
+bool perf_open(void)
+{
+    int opened = 0;
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        if (counters[i].fd < 0)
+            counters[i].fd = perf_event_open(&attr);
+        if (counters[i].fd >= 0)
+            opened++;
+    }
+    return opened > 0;
+}
+
+void perf_close(void)
+{
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (counters[i].fd >= 0)
+            close(counters[i].fd);
+        counters[i].fd = -1;
+    }
+}
+
+void perf_begin(void)
+{
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (counters[i].fd >= 0 &&
+            !perf_read(&counters[i], counters[i].start))
+            memset(counters[i].start, 0, sizeof(counters[i].start));
+    }
+}
+
+void perf_end(const char *name)
+{
+    uint64_t delta[N_COUNTERS];
+    bool valid[N_COUNTERS];
+    bool any = false;
+
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        valid[i] = counters[i].fd >= 0;
+        delta[i] = valid[i] ? perf_delta(&counters[i]) : 0;
+        any |= valid[i];
+    }
+    if (!any)
+        return;
+
+    report_noreturn(1, "perf %s:", name);
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (valid[i])
+            report_noreturn(1, " %s %lu", counters[i].name,
+                            (unsigned long) delta[i]);
+    }
+    if (valid[PERF_CYCLES] && valid[PERF_INSTRUCTIONS] && delta[PERF_CYCLES])
+        report_noreturn(1, " (IPC %.2f)",
+                        (double) delta[PERF_INSTRUCTIONS] / delta[PERF_CYCLES]);
+    report(1, "");
+
+    int elements = scale_func ? scale_func() : 0;
+    if (elements <= 0)
+        return;
+
+    report_noreturn(1, "perf %s per element (n = %d):", name, elements);
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (valid[i])
+            report_noreturn(1, " %s %.2f", counters[i].name,
+                            (double) delta[i] / elements);
+    }
+    report(1, "");
+}
+
+#else /* !defined(__linux__) */
+
+bool perf_open(void)
+{
+    return false;
+}
+
+void perf_close(void) {}
+
+void perf_begin(void) {}
+
+void perf_end(const char *name) {}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+
+/* Hardware performance counters around console commands.
+ *
+ * Counters are opened with perf_event_open(2) for the calling thread only.
+ * Any counter the kernel refuses (no PMU in a VM, perf_event_paranoid, non
+ * Linux hosts) is simply left out of the report.
+ */
+
+/* Function returning the number of elements a command worked on */
+typedef int (*perf_scale_func_t)(void);
+
+/* Open the counters. Return false if none of them is available */
+bool perf_open(void);
+
+/* Close all counters opened by perf_open() */
+void perf_close(void);
+
+/* Set the function used to print per-element counts */
+void perf_set_scale(perf_scale_func_t func);
+
+/* Snapshot the counters before a command */
+void perf_begin(void);
+
+/* Report the counter deltas since perf_begin() for the named command */
+void perf_end(const char *name);
+
+#endif /* LAB0_PERF_H */
@@ -0,0 +1,212 @@
+/* Streaming content statistics of a queue */
+
+#include <math.h>
+#include <string.h>
+
+#include "qstats.h"
+#include "random.h"
+#include "report.h"
+
+extern void shannon_entropy_batch(const uint8_t *const *input_data,
+                                  size_t n,
+                                  double *entropy);
+
+#define HLL_REGISTERS (1 << QSTATS_HLL_BITS)
+
+void qstats_init(qstats_t *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->length_min = UINT64_MAX;
+    st->entropy_min = 100.0;
+}
+
+/* FNV-1a, followed by the MurmurHash3 finalizer, as HyperLogLog takes both
+ * the register and the rank from the hash and needs all its bits mixed.
+ */
+static uint64_t hash_string(const char *s, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t) s[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void hll_add(qstats_t *st, uint64_t h)
+{
+    uint32_t reg = h >> (64 - QSTATS_HLL_BITS);
+    /* The marker bit keeps the rank within the remaining bits */
+    uint64_t rest = (h << QSTATS_HLL_BITS) | (1ULL << (QSTATS_HLL_BITS - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    if (rank > st->hll[reg])
+        st->hll[reg] = rank;
+}
+
+/* Flajolet et al., with linear counting while registers are still empty */
+static double hll_estimate(const qstats_t *st)
+{
+    const double m = HLL_REGISTERS;
+    double sum = 0.0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -st->hll[i]);
+        zeros += !st->hll[i];
+    }
+    double estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros)
+        estimate = m * log(m / zeros);
+    return estimate;
+}
+
+static void flush_batch(qstats_t *st)
+{
+    double entropy[QSTATS_BATCH];
+    shannon_entropy_batch((const uint8_t *const *) st->batch, st->n_batch,
+                          entropy);
+    for (int i = 0; i < st->n_batch; i++) {
+        st->entropy_sum += entropy[i];
+        if (entropy[i] < st->entropy_min)
+            st->entropy_min = entropy[i];
+        if (entropy[i] > st->entropy_max)
+            st->entropy_max = entropy[i];
+    }
+    st->n_batch = 0;
+}
+
+static int length_bucket(uint64_t len)
+{
+    if (!len)
+        return 0;
+    int b = 64 - __builtin_clzll(len);
+    return b < QSTATS_LENGTH_BUCKETS ? b : QSTATS_LENGTH_BUCKETS - 1;
+}
+
+void qstats_push(qstats_t *st, const char *s)
+{
+    size_t len = strlen(s);
+    st->length_sum += len;
+    if (len < st->length_min)
+        st->length_min = len;
+    if (len > st->length_max)
+        st->length_max = len;
+    st->length_bucket[length_bucket(len)]++;
+    for (size_t i = 0; i < len; i++)
+        st->byte_count[(uint8_t) s[i]]++;
+
+    hll_add(st, hash_string(s, len));
+
+    if (st->prev) {
+        int cmp = strcmp(st->prev, s);
+        st->descents += cmp > 0;
+        st->equal_adjacent += cmp == 0;
+    }
+    st->prev = s;
+
+    /* Reservoir sampling keeps every string equally likely to be sampled */
+    if (st->count < QSTATS_SAMPLE) {
+        st->sample[st->count] = (qstats_sample_t){s, st->count};
+    } else {
+        uint32_t j = prng_bounded(st->count + 1);
+        if (j < QSTATS_SAMPLE)
+            st->sample[j] = (qstats_sample_t){s, st->count};
+    }
+
+    st->batch[st->n_batch++] = s;
+    if (st->n_batch == QSTATS_BATCH)
+        flush_batch(st);
+    st->count++;
+}
+
+/* Fraction of the sampled pairs out of order. With no more strings than
+ * the sample holds, this is exact.
+ */
+static double inverted_fraction(const qstats_t *st)
+{
+    int n = st->count < QSTATS_SAMPLE ? st->count : QSTATS_SAMPLE;
+    uint64_t pairs = 0, inverted = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            const qstats_sample_t *a = &st->sample[i], *b = &st->sample[j];
+            if (a->index > b->index) {
+                const qstats_sample_t *t = a;
+                a = b;
+                b = t;
+            }
+            inverted += strcmp(a->value, b->value) > 0;
+            pairs++;
+        }
+    }
+    return pairs ? (double) inverted / pairs : 0.0;
+}
+
+/* Shannon entropy of the bytes of all strings together, as a percentage of
+ * 8 bits per byte
+ */
+static double byte_entropy(const qstats_t *st)
+{
+    if (!st->length_sum)
+        return 0.0;
+    double entropy = 0.0;
+    for (int i = 0; i < 256; i++) {
+        if (st->byte_count[i]) {
+            double p = (double) st->byte_count[i] / st->length_sum;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy * 100.0 / 8;
+}
+
+void qstats_report(qstats_t *st, int level)
+{
+    if (st->n_batch)
+        flush_batch(st);
+    if (!st->count) {
+        report(level, "Queue is empty");
+        return;
+    }
+
+    double n = st->count;
+    report(level, "Strings: %lu, bytes: %lu", (unsigned long) st->count,
+           (unsigned long) st->length_sum);
+    report(level, "Length: min %lu, mean %.2f, max %lu",
+           (unsigned long) st->length_min, st->length_sum / n,
+           (unsigned long) st->length_max);
+    for (int b = 0; b < QSTATS_LENGTH_BUCKETS; b++) {
+        if (!st->length_bucket[b])
+            continue;
+        unsigned long lo = b ? 1UL << (b - 1) : 0;
+        if (b == QSTATS_LENGTH_BUCKETS - 1)
+            report_noreturn(level, "  %5lu-     :", lo);
+        else
+            report_noreturn(level, "  %5lu-%-5lu:", lo, b ? 2 * lo - 1 : 0);
+        report(level, " %lu (%.1f%%)", (unsigned long) st->length_bucket[b],
+               st->length_bucket[b] * 100.0 / n);
+    }
+
+    report(level,
+           "Entropy: min %.2f%%, mean %.2f%%, max %.2f%% per string, "
+           "%.2f%% over all bytes",
+           st->entropy_min, st->entropy_sum / n, st->entropy_max,
+           byte_entropy(st));
+
+    double distinct = hll_estimate(st);
+    if (distinct > n)
+        distinct = n;
+    report(level, "Distinct: ~%.0f, duplicate ratio ~%.1f%%", distinct,
+           (1.0 - distinct / n) * 100.0);
+
+    double pairs = n * (n - 1) / 2;
+    double inverted = inverted_fraction(st);
+    report(level,
+           "Sortedness: %lu ascending runs, %lu equal neighbors, "
+           "~%.0f inversions (%.1f%% of pairs)",
+           (unsigned long) st->descents + 1,
+           (unsigned long) st->equal_adjacent, inverted * pairs,
+           inverted * 100.0);
+}
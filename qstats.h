@@ -0,0 +1,57 @@
+#ifndef LAB0_QSTATS_H
+#define LAB0_QSTATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Content statistics over the strings of a queue, gathered in one pass.
+ *
+ * Strings are pushed in queue order with qstats_push() and must stay valid
+ * until qstats_report(), which keeps the pass free of copies. The distinct
+ * count is a HyperLogLog estimate and the inversion count is taken from a
+ * uniform sample of the strings, so both hold for queues of any size in
+ * fixed memory.
+ */
+
+/* HyperLogLog registers, as a power of two. 2^12 registers give a standard
+ * error of about 1.6%.
+ */
+#define QSTATS_HLL_BITS 12
+
+/* Strings whose entropy is computed at once */
+#define QSTATS_BATCH 256
+
+/* Strings sampled to estimate the inversions */
+#define QSTATS_SAMPLE 256
+
+/* Length buckets: 0, 1, 2-3, 4-7, ..., and everything from 2^15 up */
+#define QSTATS_LENGTH_BUCKETS 17
+
+typedef struct {
+    const char *value;
+    uint64_t index; /* Position in queue */
+} qstats_sample_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t length_sum, length_min, length_max;
+    uint64_t length_bucket[QSTATS_LENGTH_BUCKETS];
+    uint64_t byte_count[256];
+    double entropy_sum, entropy_min, entropy_max;
+    const char *batch[QSTATS_BATCH];
+    int n_batch;
+    uint8_t hll[1 << QSTATS_HLL_BITS];
+    const char *prev;
+    uint64_t descents, equal_adjacent;
+    qstats_sample_t sample[QSTATS_SAMPLE];
+} qstats_t;
+
+void qstats_init(qstats_t *st);
+
+/* Account for the next string of the queue */
+void qstats_push(qstats_t *st, const char *s);
+
+/* Report the statistics of all strings pushed so far */
+void qstats_report(qstats_t *st, int level);
+
+#endif /* LAB0_QSTATS_H */
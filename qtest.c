@@ -3,8 +3,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +22,7 @@
 #include <time.h>
 #endif
 
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -31,6 +35,9 @@ void shuffle(struct list_head *head);
 
 /* Shannon entropy */
 extern double shannon_entropy(const uint8_t *input_data);
+extern void shannon_entropy_batch(const uint8_t *const *input_data,
+                                  size_t n,
+                                  double *entropy);
 extern int show_entropy;
 
 /* Our program needs to use regular malloc/free */
@@ -51,11 +58,21 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "cqueue.h"
+#include "epoch.h"
+#include "perf.h"
+#include "qstats.h"
 #include "report.h"
+#include "web.h"
+#include "wsdeque.h"
 
 /* Settable parameters */
 
+/* Commands kept in the interactive history, settable with -H or 'option
+ * history'. Ctrl-R searches it through an index, so it can be large.
+ */
 #define HISTORY_LEN 20
+static int history_max = HISTORY_LEN;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
@@ -65,14 +82,66 @@ extern int show_entropy;
 
 /* Global variables */
 
+/* Queues are chained in the order they were created, and also indexed by id
+ * so that "use" and "cmd@id" find one without walking the chain.
+ */
 typedef struct {
     struct list_head head;
     int size;
+    queue_contex_t **by_id; /* Queue of each id, NULL once freed */
+    int *free_ids;          /* Ids of freed queues, handed out again first */
+    int n_ids, n_free;      /* Ids handed out so far, and freed among them */
+    int cap;                /* Slots in by_id and free_ids */
 } queue_chain_t;
 
 static queue_chain_t chain = {.size = 0};
 static queue_contex_t *current = NULL;
 
+/* Id of the queue current was before the command of a "cmd@id" */
+static int target_saved_id = -1;
+
+/* Link qctx at the end of the chain and give it an id. Reusing the ids of
+ * freed queues keeps the table no larger than the most queues there have
+ * been at once.
+ */
+static void chain_add(queue_contex_t *qctx)
+{
+    if (chain.n_free) {
+        qctx->id = chain.free_ids[--chain.n_free];
+    } else {
+        if (chain.n_ids == chain.cap) {
+            int cap = chain.cap ? 2 * chain.cap : 16;
+            queue_contex_t **by_id =
+                realloc(chain.by_id, cap * sizeof(*chain.by_id));
+            int *free_ids = realloc(chain.free_ids, cap * sizeof(int));
+            if (by_id)
+                chain.by_id = by_id;
+            if (free_ids)
+                chain.free_ids = free_ids;
+            if (!by_id || !free_ids)
+                report_event(MSG_FATAL, "Couldn't allocate queue table");
+            chain.cap = cap;
+        }
+        qctx->id = chain.n_ids++;
+    }
+    chain.by_id[qctx->id] = qctx;
+    list_add_tail(&qctx->chain, &chain.head);
+    chain.size++;
+}
+
+static void chain_remove(queue_contex_t *qctx)
+{
+    chain.by_id[qctx->id] = NULL;
+    chain.free_ids[chain.n_free++] = qctx->id;
+    list_del(&qctx->chain);
+    chain.size--;
+}
+
+static queue_contex_t *chain_find(int id)
+{
+    return id >= 0 && id < chain.n_ids ? chain.by_id[id] : NULL;
+}
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
 static int fail_count = 0;
@@ -83,6 +152,7 @@ static int descend = 0;
 
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+#define RANDSTR_BATCH 256 /* random strings generated at once */
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 /* For queue_insert and queue_remove */
 typedef enum {
@@ -117,7 +187,7 @@ static bool do_free(int argc, char *argv[])
     }
 
     if (current) {
-        list_del(&current->chain);
+        chain_remove(current);
 
         if (exception_setup(true))
             q_free(current->q);
@@ -127,7 +197,6 @@ static bool do_free(int argc, char *argv[])
 
     if (current) {
         free(current);
-        chain.size--;
         current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
     }
 
@@ -155,11 +224,10 @@ static bool do_new(int argc, char *argv[])
 
     if (exception_setup(true)) {
         queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
-        list_add_tail(&qctx->chain, &chain.head);
+        chain_add(qctx);
 
         qctx->size = 0;
         qctx->q = q_new();
-        qctx->id = chain.size++;
 
         current = qctx;
     }
@@ -169,21 +237,20 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/* TODO: Add a buf_size check of if the buf_size may be less
+/* Fill cnt random strings, buf_size bytes apart. Every slot is filled with
+ * letters in one call, which keeps the charset mapping vectorized, and then
+ * cut to a random length.
+ *
+ * TODO: Add a buf_size check of if the buf_size may be less
  * than MIN_RANDSTR_LEN.
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+static void fill_rand_strings(char *buf, size_t cnt, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
-
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
-
-    buf[len] = '\0';
+    prng_chars(buf, cnt * buf_size, charset, sizeof(charset) - 1);
+    for (size_t i = 0; i < cnt; i++) {
+        size_t len = MIN_RANDSTR_LEN + prng_bounded(buf_size - MIN_RANDSTR_LEN);
+        buf[i * buf_size + len] = '\0';
+    }
 }
 
 /* insertion */
@@ -194,6 +261,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        /* dudect prints its progress straight to stdout */
+        report_flush();
         bool ok =
             pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
         if (!ok) {
@@ -206,7 +275,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RANDSTR_BATCH][MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -224,7 +293,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
+        inserts = randstr_buf[0];
     }
 
     if (!current || !current->q)
@@ -234,8 +303,12 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            if (need_rand) {
+                if (r % RANDSTR_BATCH == 0)
+                    fill_rand_strings(randstr_buf[0], RANDSTR_BATCH,
+                                      MAX_RANDSTR_LEN);
+                inserts = randstr_buf[r % RANDSTR_BATCH];
+            }
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
             if (rval) {
@@ -306,6 +379,8 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        /* dudect prints its progress straight to stdout */
+        report_flush();
         bool ok =
             pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
         if (!ok) {
@@ -518,8 +593,65 @@ static bool do_dedup(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Times the fit is retried before an operation is found to grow too fast */
+#define COMPLEXITY_TRIES 3
+
+/* Fit the running time of an operation on queues of one shape, and check
+ * it against the bound. As with the dudect tests, one passing try is
+ * enough, since noise can throw a single fit off.
+ */
+static bool fit_complexity(int mode, int shape, complexity_t bound)
+{
+    dut_scaling_t s;
+    bool within = false;
+    for (int try = 0; try < COMPLEXITY_TRIES && !within; try++) {
+        if (!dut_scaling(mode, shape, &s)) {
+            report(1, "ERROR: Wrong implementation of %s", dut_name(mode));
+            return false;
+        }
+        within = complexity_within(&s.fit, bound);
+    }
+
+    for (int i = 0; i < SCALING_SIZES; i++)
+        report(2, "n = %5.0f: %9.0f cycles, memory %.2fx", s.n[i],
+               s.cycles[i], s.memory[i]);
+    for (complexity_t c = 0; c < N_COMPLEXITIES; c++)
+        report(2, "%-10s %9.2f cycles per unit, rms %.3f, growth %.2f",
+               complexity_name(c), s.fit.coef[c], s.fit.rms[c],
+               s.fit.growth[c]);
+
+    if (!within) {
+        report(1, "ERROR: Grows faster than %s on %s input (best fit %s)",
+               complexity_name(bound), shape_name(shape),
+               complexity_name(s.fit.best));
+        return false;
+    }
+    report(1, "Probably within %s on %s input (best fit %s)",
+           complexity_name(bound), shape_name(shape),
+           complexity_name(s.fit.best));
+    return true;
+}
+
+/* Fit the running time of an operation over growing queue sizes */
+static bool queue_scaling(int mode, int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+
+    /* The cautious-mode block lookup would dominate on long queues */
+    set_cautious_mode(false);
+    bool ok = fit_complexity(mode, SHAPE_random, dut_complexity(mode));
+    set_cautious_mode(true);
+    return ok;
+}
+
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return queue_scaling(DUT(reverse), argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -541,6 +673,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return queue_scaling(DUT(size), argc, argv);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -781,6 +916,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return queue_scaling(DUT(delete_mid), argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -807,6 +945,9 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return queue_scaling(DUT(swap), argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -975,7 +1116,6 @@ static bool do_merge(int argc, char *argv[])
     set_noallocate_mode(false);
 
     if (q_size(&chain.head) > 1) {
-        chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
 
@@ -983,12 +1123,10 @@ static bool do_merge(int argc, char *argv[])
         while ((uintptr_t) cur != (uintptr_t) &chain.head) {
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
+            chain_remove(ctx);
             q_free(ctx->q);
             free(ctx);
         }
-
-        chain.head.prev = &current->chain;
-        current->chain.next = &chain.head;
     }
 
     bool ok = true;
@@ -1071,21 +1209,27 @@ static bool q_show(int vlevel)
     struct list_head *ori = current->q;
     struct list_head *cur = current->q->next;
 
+    const char *shown[BIG_LIST_SIZE];
+    double entropy[BIG_LIST_SIZE];
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < current->size) {
             element_t *e = list_entry(cur, element_t, list);
-            if (cnt < BIG_LIST_SIZE) {
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-                if (show_entropy) {
-                    report_noreturn(
-                        vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
-                }
-            }
+            if (cnt < BIG_LIST_SIZE)
+                shown[cnt] = e->value;
             cnt++;
             cur = cur->next;
             ok = ok && !error_check();
         }
+
+        int n_shown = cnt < BIG_LIST_SIZE ? cnt : BIG_LIST_SIZE;
+        if (show_entropy)
+            shannon_entropy_batch((const uint8_t *const *) shown, n_shown,
+                                  entropy);
+        for (int i = 0; i < n_shown; i++) {
+            report_noreturn(vlevel, i == 0 ? "%s" : " %s", shown[i]);
+            if (show_entropy)
+                report_noreturn(vlevel, "(%3.2f%%)", entropy[i]);
+        }
     }
     exception_cancel();
 
@@ -1122,6 +1266,372 @@ static bool do_show(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Strings handed to shannon_entropy_batch() at once */
+#define ENTROPY_BATCH 256
+
+static bool do_entropy(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling entropy on null queue");
+        return false;
+    }
+
+    if (!is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    const char *batch[ENTROPY_BATCH];
+    double entropy[ENTROPY_BATCH];
+    double min = 100.0, max = 0.0, sum = 0.0;
+    int cnt = 0, n = 0;
+    bool ok = true;
+    error_check();
+
+    if (exception_setup(true)) {
+        struct list_head *cur = current->q->next;
+        while (ok && cur != current->q) {
+            batch[n++] = list_entry(cur, element_t, list)->value;
+            cur = cur->next;
+            ok = !error_check();
+            if (n < ENTROPY_BATCH && cur != current->q)
+                continue;
+
+            shannon_entropy_batch((const uint8_t *const *) batch, n, entropy);
+            for (int i = 0; i < n; i++) {
+                min = entropy[i] < min ? entropy[i] : min;
+                max = entropy[i] > max ? entropy[i] : max;
+                sum += entropy[i];
+            }
+            cnt += n;
+            n = 0;
+        }
+    }
+    exception_cancel();
+
+    if (!ok)
+        return false;
+    if (!cnt)
+        report(1, "Queue is empty");
+    else
+        report(1, "Entropy of %d strings: min %.2f%%, mean %.2f%%, max %.2f%%",
+               cnt, min, sum / cnt, max);
+    return !error_check();
+}
+
+static bool do_qstats(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling qstats on null queue");
+        return false;
+    }
+
+    if (!is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    qstats_t *st = malloc(sizeof(qstats_t));
+    if (!st) {
+        report(1, "Cannot allocate statistics");
+        return false;
+    }
+    qstats_init(st);
+
+    bool ok = true;
+    error_check();
+    if (exception_setup(true)) {
+        struct list_head *cur;
+        for (cur = current->q->next; ok && cur != current->q; cur = cur->next) {
+            qstats_push(st, list_entry(cur, element_t, list)->value);
+            ok = !error_check();
+        }
+        if (ok)
+            qstats_report(st, 1);
+    }
+    exception_cancel();
+
+    free(st);
+    return ok && !error_check();
+}
+
+/* Stress the concurrent queue with producer and consumer threads */
+static bool do_cstress(int argc, char *argv[])
+{
+    cq_kind_t kind = CQ_LOCK_FREE;
+    bool snapshot = false;
+    int i = 1;
+    if (i < argc && !strcmp(argv[i], "-s")) {
+        snapshot = true;
+        i++;
+    }
+    if (i < argc && !strcmp(argv[i], "lockfree")) {
+        i++;
+    } else if (i < argc && !strcmp(argv[i], "twolock")) {
+        kind = CQ_TWO_LOCK;
+        i++;
+    }
+
+    int n[3] = {2, 2, 100000}; /* producers, consumers, items */
+    if (argc - i != 0 && argc - i != 2 && argc - i != 3) {
+        report(1, "%s needs 0, 2 or 3 counts", argv[0]);
+        return false;
+    }
+    for (int j = 0; i < argc; i++, j++) {
+        if (!get_int(argv[i], &n[j]) || n[j] < 1) {
+            report(1, "Invalid count '%s'", argv[i]);
+            return false;
+        }
+    }
+
+    cq_stress_t st = {
+        .producers = n[0],
+        .consumers = n[1],
+        .items = n[2],
+        .snapshot = snapshot,
+    };
+    if (!cq_stress(kind, &st)) {
+        report(1, "ERROR: Could not run the threads");
+        return false;
+    }
+
+    long total = st.producers * st.items;
+    report(1, "%s queue: %d producers, %d consumers, %ld items in %.3f s "
+           "(%.2f M items/s)",
+           kind == CQ_LOCK_FREE ? "Lock-free" : "Two-lock", st.producers,
+           st.consumers, total, st.seconds, total / st.seconds / 1e6);
+    report(1, "Lost: %ld, duplicated: %ld, out of order: %ld", st.lost,
+           st.duplicated, st.out_of_order);
+    if (st.lost || st.duplicated || st.out_of_order) {
+        report(1, "ERROR: Queue is not linearizable");
+        return false;
+    }
+    if (!snapshot)
+        return true;
+
+    report(1, "Snapshots: %ld, %.1f items and %.2f us each, %ld retries",
+           st.snapshots,
+           st.snapshots ? (double) st.snapshot_items / st.snapshots : 0.0,
+           st.snapshots ? st.snapshot_seconds / st.snapshots * 1e6 : 0.0,
+           st.snapshot_retries);
+    if (st.snapshot_errors) {
+        report(1, "ERROR: %ld snapshots were not consistent",
+               st.snapshot_errors);
+        return false;
+    }
+    return true;
+}
+
+/* Compare stealing from a work-stealing deque and from a locked list */
+static bool do_wsbench(int argc, char *argv[])
+{
+    int n[2] = {2, 1000000}; /* thieves, tasks */
+    if (argc > 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
+        return false;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (!get_int(argv[i], &n[i - 1]) || n[i - 1] < 1) {
+            report(1, "Invalid count '%s'", argv[i]);
+            return false;
+        }
+    }
+
+    bool ok = true;
+    for (int locked = 0; locked < 2; locked++) {
+        wsd_bench_t b = {.thieves = n[0], .tasks = n[1]};
+        if (!wsd_bench(locked, &b)) {
+            report(1, "ERROR: Could not run the threads");
+            return false;
+        }
+        report(1,
+               "%-16s %ld tasks in %.3f s (%.2f M tasks/s), %d thieves "
+               "stole %ld (%.2f M steals/s)",
+               locked ? "Locked list:" : "Chase-Lev deque:", b.tasks,
+               b.seconds, b.tasks / b.seconds / 1e6, b.thieves, b.stolen,
+               b.stolen / b.seconds / 1e6);
+        if (b.errors) {
+            report(1, "ERROR: %ld tasks were not taken exactly once",
+                   b.errors);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* Readers walking a list of elements while this thread replaces them. The
+ * list is only changed the way readers can follow: a new element is linked
+ * in complete, and a removed one keeps pointing into the list until it is
+ * freed.
+ */
+static struct {
+    struct list_head head;
+    atomic_bool stop;
+    atomic_long walks, bad;
+} estress;
+
+static void *estress_reader(void *arg)
+{
+    long walks = 0, bad = 0;
+    while (!atomic_load(&estress.stop)) {
+        epoch_enter();
+        struct list_head *cur =
+            __atomic_load_n(&estress.head.next, __ATOMIC_ACQUIRE);
+        for (; cur != &estress.head;
+             cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE)) {
+            /* Freed blocks are filled with a byte outside the charset */
+            const char *v = list_entry(cur, element_t, list)->value;
+            size_t len = strspn(v, charset);
+            bad += len < MIN_RANDSTR_LEN || v[len];
+        }
+        epoch_exit();
+        walks++;
+    }
+    atomic_fetch_add(&estress.walks, walks);
+    atomic_fetch_add(&estress.bad, bad);
+    return NULL;
+}
+
+static void estress_release(void *p)
+{
+    q_release_element(p);
+}
+
+/* Link a new element at the tail, from the harness allocator */
+static bool estress_insert(void)
+{
+    char buf[MAX_RANDSTR_LEN];
+    fill_rand_strings(buf, 1, sizeof(buf));
+    element_t *e = test_malloc(sizeof(element_t));
+    if (!e)
+        return false;
+    if (!(e->value = test_strdup(buf))) {
+        test_free(e);
+        return false;
+    }
+    struct list_head *head = &estress.head, *last = head->prev;
+    e->list.next = head;
+    e->list.prev = last;
+    __atomic_store_n(&last->next, &e->list, __ATOMIC_RELEASE);
+    head->prev = &e->list;
+    return true;
+}
+
+/* Unlink the first element, leaving its own links as they are */
+static element_t *estress_remove(void)
+{
+    struct list_head *head = &estress.head, *first = head->next;
+    if (first == head)
+        return NULL;
+    first->next->prev = head;
+    __atomic_store_n(&head->next, first->next, __ATOMIC_RELEASE);
+    return list_entry(first, element_t, list);
+}
+
+/* Stress epoch-based reclamation of elements under the harness allocator */
+static bool do_estress(int argc, char *argv[])
+{
+    int n[3] = {2, 10000, 64}; /* readers, replacements, list length */
+    if (argc > 4) {
+        report(1, "%s needs 0-3 arguments", argv[0]);
+        return false;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (!get_int(argv[i], &n[i - 1]) || n[i - 1] < 1) {
+            report(1, "Invalid count '%s'", argv[i]);
+            return false;
+        }
+    }
+
+    error_check();
+    size_t blocks = allocation_check();
+    epoch_stats_t before, after;
+    epoch_stats(&before);
+    INIT_LIST_HEAD(&estress.head);
+    atomic_store(&estress.stop, false);
+    atomic_store(&estress.walks, 0);
+    atomic_store(&estress.bad, 0);
+    for (int i = 0; i < n[2]; i++)
+        estress_insert();
+
+    pthread_t *threads = malloc(n[0] * sizeof(pthread_t));
+    if (!threads) {
+        report(1, "ERROR: Could not run the threads");
+        return false;
+    }
+    double elapsed;
+    init_time(&elapsed);
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int started = 0;
+    for (; started < n[0]; started++) {
+        if (pthread_create(&threads[started], NULL, estress_reader, NULL))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    uint64_t max_pending = 0;
+    for (int i = 0; i < n[1]; i++) {
+        element_t *e = estress_remove();
+        if (e)
+            epoch_retire(e, estress_release);
+        estress_insert();
+        if (!(i & 0xff)) {
+            epoch_stats(&after);
+            uint64_t pending = after.retired - after.freed;
+            if (pending > max_pending)
+                max_pending = pending;
+        }
+    }
+
+    atomic_store(&estress.stop, true);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    elapsed = delta_time(&elapsed);
+
+    for (element_t *e; (e = estress_remove());)
+        epoch_retire(e, estress_release);
+    epoch_drain();
+    epoch_stats(&after);
+
+    report(1,
+           "%d readers walked the list %ld times while %d elements were "
+           "replaced in %.3f s",
+           started, atomic_load(&estress.walks), n[1], elapsed);
+    report(1, "Epoch %lu: %lu retired, %lu freed, at most %lu pending",
+           (unsigned long) after.epoch,
+           (unsigned long) (after.retired - before.retired),
+           (unsigned long) (after.freed - before.freed),
+           (unsigned long) max_pending);
+
+    bool ok = started == n[0];
+    if (!ok)
+        report(1, "ERROR: Could not run the threads");
+    long bad = atomic_load(&estress.bad);
+    if (bad) {
+        report(1, "ERROR: Readers saw %ld freed values", bad);
+        ok = false;
+    }
+    if (allocation_check() != blocks) {
+        report(1, "ERROR: %lu blocks are still allocated",
+               (unsigned long) (allocation_check() - blocks));
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
 static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1168,6 +1678,52 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+static bool do_use(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    int id;
+    if (!get_int(argv[1], &id)) {
+        report(1, "Invalid queue ID '%s'", argv[1]);
+        return false;
+    }
+
+    queue_contex_t *qctx = chain_find(id);
+    if (!qctx) {
+        report(1, "No queue with ID %d", id);
+        return false;
+    }
+    current = qctx;
+
+    return q_show(0);
+}
+
+/* Make queue 'target' current for the command of a "cmd@target" */
+static bool target_enter(const char *target)
+{
+    int id;
+    queue_contex_t *qctx;
+    if (!get_int((char *) target, &id) || !(qctx = chain_find(id))) {
+        report(1, "No queue with ID '%s'", target);
+        return false;
+    }
+    target_saved_id = current ? current->id : -1;
+    current = qctx;
+    return true;
+}
+
+/* Go back to the queue current before, unless the command freed it */
+static void target_leave(void)
+{
+    queue_contex_t *saved = chain_find(target_saved_id);
+    if (saved)
+        current = saved;
+    target_saved_id = -1;
+}
+
 /* Fisher–Yates shuffle  */
 static bool do_shuffle(int argc, char *argv[])
 {
@@ -1191,12 +1747,442 @@ static bool do_shuffle(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Micro-benchmark of queue operations.
+ *
+ * Every repetition builds its input queue from a pool of random strings that
+ * is generated once per size, so neither process startup nor the string
+ * generation shows up in the numbers.  Only the operation itself is timed.
+ */
+#define BENCH_REPS 5
+#define BENCH_WARMUP 1
+#define BENCH_REVERSEK 3
+#define BENCH_MERGE_QUEUES 4
+
+typedef struct {
+    char *pool; /* n random strings, MAX_RANDSTR_LEN bytes apart */
+    int n;
+} bench_input_t;
+
+typedef uint64_t (*bench_func_t)(const bench_input_t *in);
+
+static inline char *bench_str(const bench_input_t *in, int i)
+{
+    return in->pool + (size_t) i * MAX_RANDSTR_LEN;
+}
+
+/* Nanoseconds since start, a cpucycles_begin() reading */
+static uint64_t bench_elapsed(int64_t start)
+{
+    int64_t cycles = cpucycles_end() - start - cpucycles_overhead();
+    return cycles > 0 ? (uint64_t) cpucycles_to_ns(cycles) : 0;
+}
+
+/* Build a queue holding the first n strings of the pool, in pool order */
+static struct list_head *bench_build(const bench_input_t *in, int n)
+{
+    struct list_head *q = q_new();
+    for (int i = n - 1; q && i >= 0; i--)
+        q_insert_head(q, bench_str(in, i));
+    return q;
+}
+
+static uint64_t bench_insert(const bench_input_t *in, position_t pos)
+{
+    struct list_head *q = q_new();
+    int64_t start = cpucycles_begin();
+    for (int i = 0; i < in->n; i++) {
+        if (pos == POS_TAIL)
+            q_insert_tail(q, bench_str(in, i));
+        else
+            q_insert_head(q, bench_str(in, i));
+    }
+    uint64_t elapsed = bench_elapsed(start);
+    q_free(q);
+    return elapsed;
+}
+
+static uint64_t bench_ih(const bench_input_t *in)
+{
+    return bench_insert(in, POS_HEAD);
+}
+
+static uint64_t bench_it(const bench_input_t *in)
+{
+    return bench_insert(in, POS_TAIL);
+}
+
+static uint64_t bench_remove(const bench_input_t *in, position_t pos)
+{
+    struct list_head *q = bench_build(in, in->n);
+    element_t **removed = malloc(sizeof(element_t *) * in->n);
+    if (!removed) {
+        q_free(q);
+        return 0;
+    }
+
+    int64_t start = cpucycles_begin();
+    for (int i = 0; i < in->n; i++)
+        removed[i] = pos == POS_TAIL ? q_remove_tail(q, NULL, 0)
+                                     : q_remove_head(q, NULL, 0);
+    uint64_t elapsed = bench_elapsed(start);
+
+    /* Releasing the elements is not part of the measured operation */
+    for (int i = 0; i < in->n; i++) {
+        if (removed[i])
+            q_release_element(removed[i]);
+    }
+    free(removed);
+    q_free(q);
+    return elapsed;
+}
+
+static uint64_t bench_rh(const bench_input_t *in)
+{
+    return bench_remove(in, POS_HEAD);
+}
+
+static uint64_t bench_rt(const bench_input_t *in)
+{
+    return bench_remove(in, POS_TAIL);
+}
+
+/* Time a single in-place operation on a queue built from the whole pool */
+#define BENCH_INPLACE(name, stmt)                         \
+    static uint64_t bench_##name(const bench_input_t *in) \
+    {                                                     \
+        struct list_head *q = bench_build(in, in->n);     \
+        int64_t start = cpucycles_begin();                \
+        stmt;                                             \
+        uint64_t elapsed = bench_elapsed(start);          \
+        q_free(q);                                        \
+        return elapsed;                                   \
+    }
+
+BENCH_INPLACE(reverse, q_reverse(q))
+BENCH_INPLACE(reverseK, q_reverseK(q, BENCH_REVERSEK))
+BENCH_INPLACE(sort, q_sort(q, descend))
+BENCH_INPLACE(lx_sort, lx_sort(q))
+BENCH_INPLACE(tree_sort, tree_sort(q))
+BENCH_INPLACE(quick_sort, quick_sort(q))
+BENCH_INPLACE(sediment_sort, sediment_sort(q))
+BENCH_INPLACE(shuffle, shuffle(q))
+
+#undef BENCH_INPLACE
+
+/* Every string shows up twice, so half of the queue gets deleted */
+static uint64_t bench_dedup(const bench_input_t *in)
+{
+    struct list_head *q = q_new();
+    for (int i = 0; q && i < in->n; i++)
+        q_insert_head(q, bench_str(in, i >> 1));
+
+    int64_t start = cpucycles_begin();
+    q_delete_dup(q);
+    uint64_t elapsed = bench_elapsed(start);
+    q_free(q);
+    return elapsed;
+}
+
+/* Merge BENCH_MERGE_QUEUES sorted queues which hold n elements in total */
+static uint64_t bench_merge(const bench_input_t *in)
+{
+    LIST_HEAD(bench_chain);
+    queue_contex_t ctx[BENCH_MERGE_QUEUES];
+    for (int i = 0; i < BENCH_MERGE_QUEUES; i++) {
+        ctx[i].q = q_new();
+        ctx[i].id = i;
+        ctx[i].size = 0;
+        for (int j = i; j < in->n; j += BENCH_MERGE_QUEUES) {
+            q_insert_head(ctx[i].q, bench_str(in, j));
+            ctx[i].size++;
+        }
+        q_sort(ctx[i].q, descend);
+        list_add_tail(&ctx[i].chain, &bench_chain);
+    }
+
+    int64_t start = cpucycles_begin();
+    q_merge(&bench_chain, descend);
+    uint64_t elapsed = bench_elapsed(start);
+
+    for (int i = 0; i < BENCH_MERGE_QUEUES; i++)
+        q_free(ctx[i].q);
+    return elapsed;
+}
+
+static const struct {
+    char *name;
+    bench_func_t func;
+} bench_ops[] = {
+    {"ih", bench_ih},
+    {"it", bench_it},
+    {"rh", bench_rh},
+    {"rt", bench_rt},
+    {"reverse", bench_reverse},
+    {"reverseK", bench_reverseK},
+    {"sort", bench_sort},
+    {"lx_sort", bench_lx_sort},
+    {"tree_sort", bench_tree_sort},
+    {"quick_sort", bench_quick_sort},
+    {"sediment_sort", bench_sediment_sort},
+    {"merge", bench_merge},
+    {"dedup", bench_dedup},
+    {"shuffle", bench_shuffle},
+};
+
+#define N_BENCH_OPS (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Run one operation and return its median time in nanoseconds */
+static double bench_run(int op, const bench_input_t *in, int reps, int warmup)
+{
+    uint64_t *samples = malloc(sizeof(uint64_t) * reps);
+    if (!samples) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for samples");
+        return -1;
+    }
+
+    bool ok = true;
+    for (int r = 0; ok && r < warmup + reps; r++) {
+        uint64_t t = 0;
+        if (exception_setup(false))
+            t = bench_ops[op].func(in);
+        else
+            ok = false;
+        exception_cancel();
+        if (r >= warmup)
+            samples[r - warmup] = t;
+    }
+    if (!ok) {
+        free(samples);
+        return -1;
+    }
+
+    qsort(samples, reps, sizeof(uint64_t), bench_cmp);
+    double mean = 0, var = 0;
+    for (int r = 0; r < reps; r++)
+        mean += samples[r];
+    mean /= reps;
+    for (int r = 0; r < reps; r++)
+        var += (samples[r] - mean) * (samples[r] - mean);
+    var = reps > 1 ? var / (reps - 1) : 0;
+
+    double median = reps & 1
+                        ? samples[reps / 2]
+                        : (samples[reps / 2 - 1] + samples[reps / 2]) / 2.0;
+    report(1,
+           "%-14s n = %-8d min %10.3f ms  median %10.3f ms  stddev %8.3f ms  "
+           "%8.2f ns/elem",
+           bench_ops[op].name, in->n, samples[0] / 1e6, median / 1e6,
+           sqrt(var) / 1e6, median / in->n);
+    free(samples);
+    return median;
+}
+
+/* Select operations from a comma separated list, or "all" */
+static bool bench_select(char *list, bool *selected)
+{
+    if (!strcmp(list, "all")) {
+        for (size_t i = 0; i < N_BENCH_OPS; i++)
+            selected[i] = true;
+        return true;
+    }
+
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        size_t i = 0;
+        while (i < N_BENCH_OPS && strcmp(name, bench_ops[i].name))
+            i++;
+        if (i == N_BENCH_OPS) {
+            report(1, "Unknown benchmark operation '%s'", name);
+            return false;
+        }
+        selected[i] = true;
+    }
+    return true;
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    int reps = BENCH_REPS, warmup = BENCH_WARMUP;
+    char *outfile = NULL;
+    int i = 1;
+
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-r")) {
+            if (!get_int(argv[i + 1], &reps) || reps < 1) {
+                report(1, "Invalid number of repetitions '%s'", argv[i + 1]);
+                return false;
+            }
+        } else if (!strcmp(argv[i], "-w")) {
+            if (!get_int(argv[i + 1], &warmup) || warmup < 0) {
+                report(1, "Invalid number of warmup runs '%s'", argv[i + 1]);
+                return false;
+            }
+        } else if (!strcmp(argv[i], "-o")) {
+            outfile = argv[i + 1];
+        } else {
+            report(1, "Unknown benchmark option '%s'", argv[i]);
+            return false;
+        }
+    }
+
+    if (argc - i < 2) {
+        report(1, "%s needs an operation list and at least one size", argv[0]);
+        return false;
+    }
+
+    bool selected[N_BENCH_OPS] = {false};
+    if (!bench_select(argv[i++], selected))
+        return false;
+
+    FILE *csv = NULL;
+    if (outfile) {
+        csv = fopen(outfile, "w");
+        if (!csv) {
+            report(1, "Could not open benchmark output file '%s'", outfile);
+            return false;
+        }
+        /* Same layout as sort_result.csv, which sort_perf.gp plots */
+        fprintf(csv, "# Length");
+        for (size_t op = 0; op < N_BENCH_OPS; op++) {
+            if (selected[op])
+                fprintf(csv, " %s", bench_ops[op].name);
+        }
+        fprintf(csv, "\n");
+    }
+
+    /* Benchmarks are long running by nature and must not be disturbed by
+     * injected malloc failures or the cautious-mode block lookup.
+     */
+    int saved_fail_probability = fail_probability;
+    fail_probability = 0;
+    set_cautious_mode(false);
+
+    bool ok = true;
+    for (; ok && i < argc; i++) {
+        bench_input_t in;
+        if (!get_int(argv[i], &in.n) || in.n < 1) {
+            report(1, "Invalid benchmark size '%s'", argv[i]);
+            ok = false;
+            break;
+        }
+
+        in.pool = malloc((size_t) in.n * MAX_RANDSTR_LEN);
+        if (!in.pool) {
+            report(1, "INTERNAL ERROR.  Could not allocate benchmark input");
+            ok = false;
+            break;
+        }
+        fill_rand_strings(in.pool, in.n, MAX_RANDSTR_LEN);
+
+        if (csv)
+            fprintf(csv, "%d", in.n);
+        for (size_t op = 0; ok && op < N_BENCH_OPS; op++) {
+            if (!selected[op])
+                continue;
+            double median = bench_run(op, &in, reps, warmup);
+            if (median < 0)
+                ok = false;
+            else if (csv)
+                fprintf(csv, " %.2f", median / 1e6);
+        }
+        if (csv)
+            fprintf(csv, "\n");
+        free(in.pool);
+    }
+
+    set_cautious_mode(true);
+    fail_probability = saved_fail_probability;
+    if (csv)
+        fclose(csv);
+
+    return ok && !error_check();
+}
+
+static const struct {
+    char *name;
+    int mode;
+} complexity_ops[] = {
+    {"ih", DUT(insert_head)},
+    {"it", DUT(insert_tail)},
+    {"rh", DUT(remove_head)},
+    {"rt", DUT(remove_tail)},
+    {"size", DUT(size)},
+    {"dm", DUT(delete_mid)},
+    {"swap", DUT(swap)},
+    {"reverse", DUT(reverse)},
+    {"sort", DUT(sort)},
+    {"dedup", DUT(delete_dup)},
+    {"ascend", DUT(ascend)},
+    {"descend", DUT(descend)},
+    {"merge", DUT(merge)},
+};
+
+#define N_COMPLEXITY_OPS (sizeof(complexity_ops) / sizeof(complexity_ops[0]))
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s takes 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    size_t op = 0;
+    while (op < N_COMPLEXITY_OPS && strcmp(argv[1], complexity_ops[op].name))
+        op++;
+    if (op == N_COMPLEXITY_OPS) {
+        report(1, "Unknown operation '%s'", argv[1]);
+        return false;
+    }
+
+    int mode = complexity_ops[op].mode;
+    complexity_t bound = dut_complexity(mode);
+    if (argc == 3 && !complexity_parse(argv[2], &bound)) {
+        report(1, "Invalid complexity bound '%s'", argv[2]);
+        return false;
+    }
+
+    /* Like benchmarks, not to be disturbed by injected malloc failures or
+     * the cautious-mode block lookup
+     */
+    int saved_fail_probability = fail_probability;
+    fail_probability = 0;
+    set_cautious_mode(false);
+
+    bool ok = true;
+    if (exception_setup(false)) {
+        for (int shape = 0; shape < N_SHAPES; shape++)
+            ok = fit_complexity(mode, shape, bound) && ok;
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+
+    set_cautious_mode(true);
+    fail_probability = saved_fail_probability;
+
+    return ok && !error_check();
+}
+
+static void set_history(int oldval)
+{
+    if (history_max < 1 || !line_history_set_max_len(history_max)) {
+        report(1, "History length must be positive");
+        history_max = oldval;
+    }
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
     ADD_COMMAND(free, "Delete queue", "");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
+    ADD_COMMAND(use, "Switch to queue with given ID", "id");
     ADD_COMMAND(ih,
                 "Insert string str at head of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
@@ -1221,6 +2207,14 @@ static void console_init()
                 "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
+    ADD_COMMAND(entropy,
+                "Show the minimum, mean and maximum Shannon entropy of the "
+                "strings in queue",
+                "");
+    ADD_COMMAND(qstats,
+                "Show length, entropy, distinct count and sortedness "
+                "statistics of the strings in queue",
+                "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
@@ -1236,6 +2230,29 @@ static void console_init()
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
     ADD_COMMAND(shuffle, "Fisher-Yates shuffle", "");
+    ADD_COMMAND(complexity,
+                "Fit the running time of an operation over growing sizes and "
+                "input shapes, and check it against a bound",
+                "cmd [bound]");
+    ADD_COMMAND(bench,
+                "Benchmark queue operations on n random strings in isolation. "
+                "Write results as CSV with -o",
+                "[-r reps] [-w warmup] [-o file] op[,op...]|all n ...");
+    ADD_COMMAND(cstress,
+                "Insert and remove strings from producer and consumer threads "
+                "on a concurrent queue, and check the order they come out. "
+                "Take snapshots meanwhile with -s",
+                "[-s] [lockfree|twolock] [producers consumers [items]]");
+    ADD_COMMAND(wsbench,
+                "Take tasks from a work-stealing deque and from a locked list "
+                "while thieves steal, and compare throughput",
+                "[thieves [tasks]]");
+    ADD_COMMAND(estress,
+                "Replace elements while reader threads walk them, freeing "
+                "them through epoch-based reclamation",
+                "[readers [replacements [length]]]");
+    set_cmd_target(target_enter, target_leave);
+
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1244,6 +2261,10 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("threads", &dudect_threads,
+              "Threads measuring in simulation mode (0: one per CPU)", NULL);
+    add_param("history", &history_max, "Number of commands kept in history",
+              set_history);
 }
 
 /* Signal handlers */
@@ -1265,10 +2286,20 @@ static void sigalrm_handler(int sig)
         "code is too inefficient");
 }
 
+/* Number of elements in the current queue, for per-element counters and
+ * web replies
+ */
+static int current_size(void)
+{
+    return current ? current->size : 0;
+}
+
 static void q_init()
 {
     fail_count = 0;
     INIT_LIST_HEAD(&chain.head);
+    perf_set_scale(current_size);
+    web_set_size_func(current_size);
     signal(SIGSEGV, sigsegv_handler);
     signal(SIGALRM, sigalrm_handler);
 }
@@ -1289,6 +2320,11 @@ static bool q_quit(int argc, char *argv[])
             chain.size--;
         }
     }
+    free(chain.by_id);
+    free(chain.free_ids);
+    chain.by_id = NULL;
+    chain.free_ids = NULL;
+    chain.n_ids = chain.n_free = chain.cap = 0;
 
     exception_cancel();
     set_cautious_mode(true);
@@ -1305,11 +2341,12 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-H HLEN]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-H HLEN    Keep HLEN commands in history\n");
     exit(0);
 }
 
@@ -1522,7 +2559,7 @@ int main(int argc, char *argv[])
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:H:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1547,6 +2584,16 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'H': {
+            char *endptr;
+            errno = 0;
+            history_max = strtol(optarg, &endptr, 10);
+            if (errno != 0 || endptr == optarg || history_max < 1) {
+                fprintf(stderr, "Invalid history length\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1568,8 +2615,9 @@ int main(int argc, char *argv[])
         /* Trigger call back function(auto completion) */
         line_set_completion_callback(completion);
 
-        line_history_set_max_len(HISTORY_LEN);
-        line_history_load(HISTORY_FILE); /* Load the history at startup */
+        line_history_set_max_len(history_max);
+        /* Load the history at startup and append new lines as they come */
+        line_history_journal(HISTORY_FILE);
     }
 
     set_verblevel(level);
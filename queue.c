@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "random.h"
+
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
  * following line.
@@ -688,7 +690,7 @@ void shuffle(struct list_head *head)
         return;
     struct list_head *node = head->next;
     for (int i = q_size(head); i >= 2; i--) {
-        int random = rand() % i;
+        int random = prng_bounded(i);
         for (int j = 0; j < random; j++)
             node = node->next;
 
@@ -28,6 +28,10 @@
 #define _GNU_SOURCE
 #endif
 
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
 #include "random.h"
 
 #if defined(__linux__) || defined(__GNU__)
@@ -291,3 +295,298 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Buffered generator.
+ *
+ * Calling randombytes() for every few bytes costs a system call each time,
+ * which dominates when generating many random strings. Instead, ChaCha20 is
+ * run in counter mode under a key taken from the OS, filling a buffer of
+ * PRNG_BLOCKS blocks at a time. The first block of every refill replaces the
+ * key ("fast key erasure"), and the served bytes are wiped, so earlier output
+ * can not be recovered from the state. Fresh OS entropy is mixed into the key
+ * every PRNG_RESEED refills.
+ */
+
+#define PRNG_BLOCKS 64
+#define PRNG_RESEED 1024
+
+typedef struct {
+    uint32_t key[8];
+    uint8_t buf[PRNG_BLOCKS * 64];
+    size_t avail; /* unread bytes at the end of buf */
+    unsigned refills;
+} prng_state_t;
+
+static __thread prng_state_t prng;
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define CHACHA_QR(a, b, c, d) \
+    do {                      \
+        a += b;               \
+        d ^= a;               \
+        d = ROTL32(d, 16);    \
+        c += d;               \
+        b ^= c;               \
+        b = ROTL32(b, 12);    \
+        a += b;               \
+        d ^= a;               \
+        d = ROTL32(d, 8);     \
+        c += d;               \
+        b ^= c;               \
+        b = ROTL32(b, 7);     \
+    } while (0)
+
+/* One ChaCha20 block with a zero nonce; keys are never reused */
+static void chacha20_block(const uint32_t key[8],
+                           uint32_t counter,
+                           uint8_t out[64])
+{
+    uint32_t in[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, /* "expand 32-byte k" */
+        key[0],     key[1],     key[2],     key[3],
+        key[4],     key[5],     key[6],     key[7],
+        counter,    0,          0,          0,
+    };
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        CHACHA_QR(x[0], x[4], x[8], x[12]);
+        CHACHA_QR(x[1], x[5], x[9], x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8], x[13]);
+        CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+/* Mix fresh OS entropy into the key */
+static void prng_reseed(void)
+{
+    uint32_t seed[8] = {0};
+    if (randombytes((uint8_t *) seed, sizeof(seed)) != 0) {
+        /* Better than nothing if the OS source is unavailable */
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed[0] ^= ts.tv_nsec;
+        seed[1] ^= ts.tv_sec;
+        seed[2] ^= (uint32_t) (uintptr_t) &prng;
+    }
+    for (int i = 0; i < 8; i++)
+        prng.key[i] ^= seed[i];
+}
+
+static void prng_refill(void)
+{
+    if (prng.refills++ % PRNG_RESEED == 0)
+        prng_reseed();
+
+    uint8_t next[64];
+    chacha20_block(prng.key, 0, next);
+    for (int i = 0; i < 8; i++)
+        prng.key[i] = (uint32_t) next[4 * i] | (uint32_t) next[4 * i + 1] << 8 |
+                      (uint32_t) next[4 * i + 2] << 16 |
+                      (uint32_t) next[4 * i + 3] << 24;
+    for (uint32_t i = 0; i < PRNG_BLOCKS; i++)
+        chacha20_block(prng.key, i + 1, prng.buf + 64 * i);
+    prng.avail = sizeof(prng.buf);
+}
+
+void prng_bytes(void *buf, size_t len)
+{
+    uint8_t *out = buf;
+    while (len > 0) {
+        if (!prng.avail)
+            prng_refill();
+        size_t n = len < prng.avail ? len : prng.avail;
+        uint8_t *src = prng.buf + sizeof(prng.buf) - prng.avail;
+        memcpy(out, src, n);
+        memset(src, 0, n);
+        prng.avail -= n;
+        out += n;
+        len -= n;
+    }
+}
+
+uint64_t prng_u64(void)
+{
+    uint64_t x;
+    prng_bytes(&x, sizeof(x));
+    return x;
+}
+
+/* Lemire's multiply-shift with rejection, see
+ * <https://arxiv.org/abs/1805.10941>
+ */
+uint32_t prng_bounded(uint32_t n)
+{
+    uint32_t x;
+    prng_bytes(&x, sizeof(x));
+    uint64_t m = (uint64_t) x * n;
+    uint32_t low = m;
+    if (low < n) {
+        uint32_t threshold = -n % n;
+        while (low < threshold) {
+            prng_bytes(&x, sizeof(x));
+            m = (uint64_t) x * n;
+            low = m;
+        }
+    }
+    return m >> 32;
+}
+
+/* Charset mapping.
+ *
+ * Every character is taken from a 16-bit random word r with multiply-shift
+ * range reduction: the character index is (r * n) >> 16. On its own this
+ * favors some indexes slightly, so words whose low half (r * n) & 0xffff is
+ * below 65536 % n are rejected, which makes the mapping exactly uniform
+ * (Lemire, <https://arxiv.org/abs/1805.10941>). For 26 letters only 16 in
+ * 65536 words are rejected, so the vector versions map a whole register at
+ * once and only fall back to the scalar loop for registers holding a
+ * rejected word. They need the charset to be a contiguous range of
+ * characters; others are mapped through the table by the scalar loop.
+ */
+
+static size_t map_chars_scalar(char *out,
+                               const uint16_t *r,
+                               size_t cnt,
+                               const char *charset,
+                               uint32_t n,
+                               uint16_t threshold)
+{
+    size_t k = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        uint32_t m = r[i] * n;
+        if ((uint16_t) m >= threshold)
+            out[k++] = charset[m >> 16];
+    }
+    return k;
+}
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define HAVE_SSE2 1
+
+static size_t map_chars_sse2(char *out,
+                             const uint16_t *r,
+                             size_t cnt,
+                             const char *charset,
+                             uint32_t n,
+                             uint16_t threshold)
+{
+    const __m128i vn = _mm_set1_epi16(n);
+    const __m128i vthres = _mm_set1_epi16(threshold);
+    const __m128i vbase = _mm_set1_epi8(charset[0]);
+    size_t i = 0, k = 0;
+
+    for (; i + 8 <= cnt; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (r + i));
+        __m128i lo = _mm_mullo_epi16(x, vn);
+        /* Unsigned lo < threshold iff threshold - lo does not saturate */
+        __m128i reject = _mm_subs_epu16(vthres, lo);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(reject, _mm_setzero_si128())) !=
+            0xffff) {
+            k += map_chars_scalar(out + k, r + i, 8, charset, n, threshold);
+            continue;
+        }
+        __m128i idx = _mm_mulhi_epu16(x, vn);
+        __m128i c = _mm_add_epi8(_mm_packus_epi16(idx, idx), vbase);
+        _mm_storel_epi64((__m128i *) (out + k), c);
+        k += 8;
+    }
+    return k + map_chars_scalar(out + k, r + i, cnt - i, charset, n, threshold);
+}
+
+#if defined(__GNUC__)
+#define HAVE_AVX2 1
+
+__attribute__((target("avx2"))) static size_t map_chars_avx2(
+    char *out,
+    const uint16_t *r,
+    size_t cnt,
+    const char *charset,
+    uint32_t n,
+    uint16_t threshold)
+{
+    const __m256i vn = _mm256_set1_epi16(n);
+    const __m256i vthres = _mm256_set1_epi16(threshold);
+    const __m128i vbase = _mm_set1_epi8(charset[0]);
+    size_t i = 0, k = 0;
+
+    for (; i + 16 <= cnt; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (r + i));
+        __m256i lo = _mm256_mullo_epi16(x, vn);
+        __m256i reject = _mm256_subs_epu16(vthres, lo);
+        if (!_mm256_testz_si256(reject, reject)) {
+            k += map_chars_scalar(out + k, r + i, 16, charset, n, threshold);
+            continue;
+        }
+        __m256i idx = _mm256_mulhi_epu16(x, vn);
+        __m128i c = _mm_packus_epi16(_mm256_castsi256_si128(idx),
+                                     _mm256_extracti128_si256(idx, 1));
+        _mm_storeu_si128((__m128i *) (out + k), _mm_add_epi8(c, vbase));
+        k += 16;
+    }
+    return k + map_chars_sse2(out + k, r + i, cnt - i, charset, n, threshold);
+}
+#endif
+#endif
+
+typedef size_t (*map_chars_func_t)(char *out,
+                                   const uint16_t *r,
+                                   size_t cnt,
+                                   const char *charset,
+                                   uint32_t n,
+                                   uint16_t threshold);
+
+/* Chosen once, as strings may be generated on several threads */
+static map_chars_func_t map_vector = map_chars_scalar;
+static pthread_once_t map_vector_once = PTHREAD_ONCE_INIT;
+
+static void map_chars_vector(void)
+{
+#if defined(HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        map_vector = map_chars_avx2;
+        return;
+    }
+#endif
+#if defined(HAVE_SSE2)
+    map_vector = map_chars_sse2;
+#endif
+}
+
+void prng_chars(char *buf, size_t len, const char *charset, size_t n)
+{
+    pthread_once(&map_vector_once, map_chars_vector);
+
+    map_chars_func_t map = map_vector;
+    for (size_t i = 1; i < n; i++) {
+        if (charset[i] != charset[0] + (char) i) {
+            map = map_chars_scalar;
+            break;
+        }
+    }
+
+    const uint16_t threshold = 65536 % n;
+    uint16_t r[256];
+    while (len > 0) {
+        size_t cnt = len < 256 ? len : 256;
+        prng_bytes(r, cnt * sizeof(uint16_t));
+        size_t k = map(buf, r, cnt, charset, n, threshold);
+        buf += k;
+        len -= k;
+    }
+}
@@ -6,10 +6,24 @@
 
 extern int randombytes(uint8_t *buf, size_t len);
 
+/* Buffered ChaCha20 generator keyed from randombytes(). Much cheaper than
+ * randombytes() for small requests. The state is per thread.
+ */
+void prng_bytes(void *buf, size_t len);
+uint64_t prng_u64(void);
+
+/* Uniform random number in [0, n), n > 0 */
+uint32_t prng_bounded(uint32_t n);
+
+/* Fill buf with len characters drawn uniformly from the n characters of
+ * charset (n <= 256). buf is not NUL-terminated.
+ */
+void prng_chars(char *buf, size_t len, const char *charset, size_t n);
+
 static inline uint8_t randombit(void)
 {
     uint8_t ret = 0;
-    randombytes(&ret, 1);
+    prng_bytes(&ret, 1);
     return ret & 1;
 }
 
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -14,15 +15,69 @@
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
+#define BUF_SIZE 4096
+
+/* Output of report() and report_noreturn() is formatted once, straight into
+ * this buffer, and written out by report_flush() at command boundaries or
+ * when it fills up, rather than flushed line by line. Worker threads may
+ * report too (see dudect), so the buffer and the files are only touched
+ * under report_lock. The time limit leaves a command with siglongjmp() from
+ * the SIGALRM handler, so SIGALRM is held off while the lock is taken.
+ */
+#define LOG_BUF_SIZE (64 * 1024)
+
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
 
+static char log_buf[LOG_BUF_SIZE];
+static size_t log_len = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Take report_lock, saving the signal mask to restore in unlock_report() */
+static void lock_report(sigset_t *old)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, old);
+    pthread_mutex_lock(&report_lock);
+}
+
+static void unlock_report(const sigset_t *old)
+{
+    pthread_mutex_unlock(&report_lock);
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
 {
     errfile = efile;
     verbfile = vfile;
+    atexit(report_flush);
+}
+
+/* Write out the log buffer. The caller holds report_lock */
+static void log_flush(void)
+{
+    if (!log_len)
+        return;
+    fwrite(log_buf, 1, log_len, verbfile);
+    fflush(verbfile);
+    if (logfile) {
+        fwrite(log_buf, 1, log_len, logfile);
+        fflush(logfile);
+    }
+    log_len = 0;
+}
+
+void report_flush(void)
+{
+    sigset_t old;
+    lock_report(&old);
+    log_flush();
+    unlock_report(&old);
 }
 
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
@@ -47,7 +102,11 @@ void set_verblevel(int level)
 
 bool set_logfile(const char *file_name)
 {
+    sigset_t old;
+    lock_report(&old);
+    log_flush();
     logfile = fopen(file_name, "w");
+    unlock_report(&old);
     return logfile != NULL;
 }
 
@@ -68,8 +127,11 @@ void report_event(message_t msg, char *fmt, ...)
     if (verblevel < level)
         return;
 
+    sigset_t old;
+    lock_report(&old);
     if (!errfile)
         init_files(stdout, stdout);
+    log_flush();
 
     va_start(ap, fmt);
     fprintf(errfile, "%s: ", msg_name);
@@ -78,6 +140,15 @@ void report_event(message_t msg, char *fmt, ...)
     fflush(errfile);
     va_end(ap);
 
+    char buffer[BUF_SIZE];
+    int len = snprintf(buffer, BUF_SIZE, "%s: ", msg_name);
+    va_start(ap, fmt);
+    vsnprintf(buffer + len, BUF_SIZE - len - 1, fmt, ap);
+    va_end(ap);
+    len = strlen(buffer);
+    buffer[len++] = '\n';
+    web_append(buffer, len);
+
     if (logfile) {
         va_start(ap, fmt);
         fprintf(logfile, "Error: ");
@@ -85,77 +156,94 @@ void report_event(message_t msg, char *fmt, ...)
         fprintf(logfile, "\n");
         fflush(logfile);
         va_end(ap);
-        fclose(logfile);
     }
 
     if (fatal) {
         if (fatal_fun)
             fatal_fun();
+        if (logfile)
+            fclose(logfile);
+        logfile = NULL;
+        /* exit() flushes the log buffer again */
+        unlock_report(&old);
         exit(1);
     }
+    unlock_report(&old);
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
-void report(int level, char *fmt, ...)
+/* Format a message into the log buffer, and hand the same bytes to the web
+ * server. A message too long for the buffer is written straight through, and
+ * only its start reaches the web server. The caller holds report_lock.
+ */
+static void report_vappend(char *fmt, va_list ap, bool newline)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
-        va_end(ap);
+    va_list aq;
+    va_copy(aq, ap);
+    size_t room = LOG_BUF_SIZE - log_len;
+    int len = vsnprintf(log_buf + log_len, room, fmt, aq);
+    va_end(aq);
+    if (len < 0)
+        return;
 
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
+    if ((size_t) len + newline >= room) {
+        log_flush();
+        va_copy(aq, ap);
+        vsnprintf(log_buf, LOG_BUF_SIZE, fmt, aq);
+        va_end(aq);
+        if ((size_t) len + newline >= LOG_BUF_SIZE) {
+            web_append(log_buf, strlen(log_buf));
+            va_copy(aq, ap);
+            vfprintf(verbfile, fmt, aq);
+            va_end(aq);
+            if (newline)
+                fputc('\n', verbfile);
+            if (logfile) {
+                va_copy(aq, ap);
+                vfprintf(logfile, fmt, aq);
+                va_end(aq);
+                if (newline)
+                    fputc('\n', logfile);
+            }
+            if (newline)
+                web_append("\n", 1);
+            return;
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
     }
+
+    char *msg = log_buf + log_len;
+    if (newline)
+        msg[len++] = '\n';
+    web_append(msg, len);
+    log_len += len;
 }
 
-void report_noreturn(int level, char *fmt, ...)
+void report(int level, char *fmt, ...)
 {
-    if (!verbfile)
-        init_files(stdout, stdout);
-
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
+        sigset_t old;
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
+        lock_report(&old);
+        report_vappend(fmt, ap, true);
+        unlock_report(&old);
         va_end(ap);
+    }
+}
 
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
+void report_noreturn(int level, char *fmt, ...)
+{
+    if (level <= verblevel) {
+        va_list ap;
+        sigset_t old;
         va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        lock_report(&old);
+        report_vappend(fmt, ap, false);
+        unlock_report(&old);
         va_end(ap);
     }
-
-    if (web_connfd)
-        web_send(web_connfd, buffer);
 }
 
 /* Functions denoting failures */
@@ -163,6 +251,7 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(const char *format, const char *msg)
 {
+    report_flush();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -179,6 +268,7 @@ static void fail_fun(const char *format, const char *msg)
 
     if (logfile)
         fclose(logfile);
+    logfile = NULL;
 
     exit(1);
 }
@@ -1,6 +1,6 @@
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <string.h>
 
 /* Precalculated log2 realization */
 #include "log2_lshift16.h"
@@ -8,27 +8,168 @@
 /* Shannon full integer entropy calculation */
 #define BUCKET_SIZE (1 << 8)
 
-double shannon_entropy(const uint8_t *s)
+/* Consecutive bytes are counted into different histograms, so that a run of
+ * the same byte does not make every increment wait for the store of the one
+ * before it.
+ */
+#define N_HISTOGRAMS 4
+
+/* Strings up to this length find their buckets by walking the string again,
+ * rather than scanning all of them.
+ */
+#define SHORT_STRING BUCKET_SIZE
+
+typedef struct {
+    uint32_t bucket[N_HISTOGRAMS][BUCKET_SIZE];
+} histogram_t;
+
+/* Count the bytes of s into h, which must be all zero on entry, and return
+ * the length of s
+ */
+static uint64_t histogram_count(histogram_t *h, const uint8_t *s)
+{
+    const uint8_t *p = s;
+    for (;; p += N_HISTOGRAMS) {
+        if (!p[0])
+            break;
+        h->bucket[0][p[0]]++;
+        if (!p[1]) {
+            p += 1;
+            break;
+        }
+        h->bucket[1][p[1]]++;
+        if (!p[2]) {
+            p += 2;
+            break;
+        }
+        h->bucket[2][p[2]]++;
+        if (!p[3]) {
+            p += 3;
+            break;
+        }
+        h->bucket[3][p[3]]++;
+    }
+    return p - s;
+}
+
+static inline uint64_t entropy_term(uint64_t p, uint64_t count)
+{
+    p *= LOG2_ARG_SHIFT / count;
+    return -p * log2_lshift16(p);
+}
+
+/* Take the count of every byte in s out of the histogram. Each bucket is
+ * read the first time its byte is seen and cleared, so later occurrences
+ * add nothing and the histogram is left all zero for the next string.
+ */
+static uint64_t entropy_sum_short(histogram_t *h,
+                                  const uint8_t *s,
+                                  uint64_t count)
 {
-    assert(s);
-    const uint64_t count = strlen((char *) s);
     uint64_t entropy_sum = 0;
-    const uint64_t entropy_max = 8 * LOG2_RET_SHIFT;
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t c = s[i];
+        uint64_t p = 0;
+        for (int j = 0; j < N_HISTOGRAMS; j++) {
+            p += h->bucket[j][c];
+            h->bucket[j][c] = 0;
+        }
+        if (p)
+            entropy_sum += entropy_term(p, count);
+    }
+    return entropy_sum;
+}
+
+/* Fold the histograms into the first one and clear the others */
+static void histogram_merge_scalar(histogram_t *h)
+{
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        for (int j = 1; j < N_HISTOGRAMS; j++) {
+            h->bucket[0][i] += h->bucket[j][i];
+            h->bucket[j][i] = 0;
+        }
+    }
+}
 
-    uint32_t bucket[256];
-    memset(&bucket, 0, sizeof(bucket));
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
 
-    for (uint32_t i = 0; i < count; i++)
-        bucket[s[i]]++;
+__attribute__((target("avx2"))) static void histogram_merge_avx2(
+    histogram_t *h)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    for (int i = 0; i < BUCKET_SIZE; i += 8) {
+        __m256i sum = _mm256_loadu_si256((__m256i *) &h->bucket[0][i]);
+        for (int j = 1; j < N_HISTOGRAMS; j++) {
+            __m256i *b = (__m256i *) &h->bucket[j][i];
+            sum = _mm256_add_epi32(sum, _mm256_loadu_si256(b));
+            _mm256_storeu_si256(b, zero);
+        }
+        _mm256_storeu_si256((__m256i *) &h->bucket[0][i], sum);
+    }
+}
+#endif
+
+typedef void (*histogram_merge_func_t)(histogram_t *h);
+
+static histogram_merge_func_t histogram_merge_func(void)
+{
+#if defined(HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+        return histogram_merge_avx2;
+#endif
+    return histogram_merge_scalar;
+}
+
+static uint64_t entropy_sum_long(histogram_t *h, uint64_t count)
+{
+    static histogram_merge_func_t merge = NULL;
+    if (!merge)
+        merge = histogram_merge_func();
+    merge(h);
 
+    uint64_t entropy_sum = 0;
     for (uint32_t i = 0; i < BUCKET_SIZE; i++) {
-        if (bucket[i]) {
-            uint64_t p = bucket[i];
-            p *= LOG2_ARG_SHIFT / count;
-            entropy_sum += -p * log2_lshift16(p);
+        if (h->bucket[0][i]) {
+            entropy_sum += entropy_term(h->bucket[0][i], count);
+            h->bucket[0][i] = 0;
         }
     }
+    return entropy_sum;
+}
 
+/* Entropy of s as a percentage of 8 bits per byte, leaving h all zero */
+static double histogram_entropy(histogram_t *h, const uint8_t *s)
+{
+    const uint64_t count = histogram_count(h, s);
+    const uint64_t entropy_max = 8 * LOG2_RET_SHIFT;
+    if (!count)
+        return 0.0;
+
+    uint64_t entropy_sum = count <= SHORT_STRING
+                               ? entropy_sum_short(h, s, count)
+                               : entropy_sum_long(h, count);
     entropy_sum /= LOG2_ARG_SHIFT;
     return entropy_sum * 100.0 / entropy_max;
 }
+
+/* Entropy of n strings at once. The histograms are only cleared once per
+ * thread, as every string leaves them all zero for the next.
+ */
+void shannon_entropy_batch(const uint8_t *const *s, size_t n, double *entropy)
+{
+    static _Thread_local histogram_t h;
+    assert(s && entropy);
+    for (size_t i = 0; i < n; i++) {
+        assert(s[i]);
+        entropy[i] = histogram_entropy(&h, s[i]);
+    }
+}
+
+double shannon_entropy(const uint8_t *s)
+{
+    double entropy;
+    shannon_entropy_batch(&s, 1, &entropy);
+    return entropy;
+}
@@ -3,126 +3,458 @@
  */
 
 #include <arpa/inet.h> /* inet_ntoa */
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strncasecmp */
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
-#define BUFSIZE 1024
+#define BUFSIZE 4096 /* initial per-connection buffer size */
+
+/* Limits on what a single request may occupy in a connection buffer */
+#define MAX_HEADER (8 * 1024)
+#define MAX_BODY (1024 * 1024)
+
+/* Stop parsing pipelined requests while this much output is unsent */
+#define OUT_HIGH (64 * 1024)
+
+#define MAX_EVENTS 64
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
 #endif
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#define TCP_CORK TCP_NOPUSH
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE is set on the socket instead */
 #endif
 
 static int server_fd;
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+/* One client connection. Requests are parsed out of the input buffer one
+ * at a time, so pipelined requests are served in order. Responses are
+ * appended to the output buffer and flushed without blocking.
+ */
+typedef struct web_conn {
+    int fd;
+    char *in;        /* received bytes */
+    size_t in_off;   /* start of the first unparsed request */
+    size_t in_len;   /* bytes in buffer */
+    size_t in_cap;   /* buffer size */
+    char *out;       /* response bytes */
+    size_t out_off;  /* first unsent byte */
+    size_t out_len;  /* bytes in buffer */
+    size_t out_cap;  /* buffer size */
+    bool want_write; /* waiting for the socket to become writable */
+    bool throttled;  /* parsing held back by unsent output */
+    bool eof;        /* peer closed its side */
+    bool closing;    /* close once the output is sent */
+    bool queued;     /* on the ready list */
+    struct web_conn *next_ready;
+
+    /* Commands of a POST request, run one per call to web_eventmux() */
+    char *batch;
+    size_t batch_pos;
+    size_t batch_len;
+    bool batch_chunked;    /* results sent with chunked encoding */
+    bool batch_keep_alive; /* keep the connection after the batch */
+
+    /* Current request */
+    bool keep_alive;
+    bool json; /* client accepts application/json */
+} web_conn_t;
 
 typedef struct {
-    char filename[512];
-    off_t offset; /* for support Range */
-    size_t end;
+    char method[16];
+    char cmd[MAXLINE]; /* decoded command line */
+    bool http11;
+    bool keep_alive;
+    bool json;
+    char *body;
+    size_t body_len;
 } http_request_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
+/* Connections indexed by file descriptor */
+static web_conn_t **conns = NULL;
+static int conns_cap = 0;
+
+/* Connections with buffered input that may hold a complete request */
+static web_conn_t *ready_head = NULL, *ready_tail = NULL;
+
+static bool stdin_watched = false;
+
+/* Command handed to the console and not finished yet */
+static struct {
+    web_conn_t *conn;
+    char cmd[MAXLINE];
+    struct timespec start;
+    char *out; /* output captured by web_append() */
+    size_t out_len;
+    size_t out_cap;
+} pending;
+
+/* Buffer for building response bodies */
+static char *scratch = NULL;
+static size_t scratch_len = 0, scratch_cap = 0;
+
+static web_size_func_t size_func = NULL;
+static web_interpret_func_t interpret_func = NULL;
+static web_done_func_t done_func = NULL;
+
+/* ========================= Event multiplexing ============================ */
+
+#if defined(__linux__)
+
+static int epoll_fd = -1;
+
+static bool mux_init(void)
 {
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd >= 0;
 }
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
- */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
+static bool mux_ctl(int op, int fd, bool want_read, bool want_write)
+{
+    struct epoll_event ev = {
+        .events = (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0),
+        .data.fd = fd,
+    };
+    return epoll_ctl(epoll_fd, op, fd, &ev) == 0;
+}
+
+static bool mux_add(int fd)
+{
+    return mux_ctl(EPOLL_CTL_ADD, fd, true, false);
+}
+
+static void mux_mod(int fd, bool want_read, bool want_write)
+{
+    mux_ctl(EPOLL_CTL_MOD, fd, want_read, want_write);
+}
+
+static void mux_del(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+typedef struct epoll_event mux_event_t;
+#define MUX_FD(e) ((e)->data.fd)
+#define MUX_READABLE(e) ((e)->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+#define MUX_WRITABLE(e) ((e)->events & (EPOLLOUT | EPOLLERR))
+
+static int mux_wait(mux_event_t *events, int max, int timeout)
+{
+    return epoll_wait(epoll_fd, events, max, timeout);
+}
 
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
+#else /* poll(2) for hosts without epoll */
+
+static struct pollfd *pfds = NULL;
+static int npfds = 0, pfds_cap = 0;
+
+static bool mux_init(void)
+{
+    return true;
+}
+
+static bool mux_add(int fd)
+{
+    if (npfds == pfds_cap) {
+        int cap = pfds_cap ? pfds_cap * 2 : 16;
+        struct pollfd *p = realloc(pfds, cap * sizeof(struct pollfd));
+        if (!p)
+            return false;
+        pfds = p;
+        pfds_cap = cap;
+    }
+    pfds[npfds].fd = fd;
+    pfds[npfds].events = POLLIN;
+    pfds[npfds].revents = 0;
+    npfds++;
+    return true;
 }
 
-static ssize_t writen(int fd, void *usrbuf, size_t n)
+static void mux_mod(int fd, bool want_read, bool want_write)
 {
-    size_t nleft = n;
-    char *bufp = usrbuf;
+    for (int i = 0; i < npfds; i++) {
+        if (pfds[i].fd == fd)
+            pfds[i].events =
+                (want_read ? POLLIN : 0) | (want_write ? POLLOUT : 0);
+    }
+}
 
-    while (nleft > 0) {
-        ssize_t nwritten = write(fd, bufp, nleft);
-        if (nwritten <= 0) {
-            if (errno == EINTR) { /* interrupted by sig handler return */
-                nwritten = 0;     /* and call write() again */
-            } else
-                return -1; /* errorno set by write() */
+static void mux_del(int fd)
+{
+    for (int i = 0; i < npfds; i++) {
+        if (pfds[i].fd == fd) {
+            pfds[i] = pfds[--npfds];
+            return;
         }
-        nleft -= nwritten;
-        bufp += nwritten;
+    }
+}
+
+typedef struct pollfd mux_event_t;
+#define MUX_FD(e) ((e)->fd)
+#define MUX_READABLE(e) ((e)->revents & (POLLIN | POLLHUP | POLLERR))
+#define MUX_WRITABLE(e) ((e)->revents & (POLLOUT | POLLERR))
+
+static int mux_wait(mux_event_t *events, int max, int timeout)
+{
+    if (poll(pfds, npfds, timeout) < 0)
+        return -1;
+    int n = 0;
+    for (int i = 0; i < npfds && n < max; i++) {
+        if (pfds[i].revents)
+            events[n++] = pfds[i];
     }
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+#endif
+
+/* ============================ Connections ================================ */
+
+static void ready_push(web_conn_t *c)
+{
+    if (c->queued)
+        return;
+    c->queued = true;
+    c->next_ready = NULL;
+    if (ready_tail)
+        ready_tail->next_ready = c;
+    else
+        ready_head = c;
+    ready_tail = c;
+}
+
+static web_conn_t *ready_pop(void)
 {
-    char c, *bufp = usrbuf;
+    web_conn_t *c = ready_head;
+    if (!c)
+        return NULL;
+    ready_head = c->next_ready;
+    if (!ready_head)
+        ready_tail = NULL;
+    c->queued = false;
+    return c;
+}
 
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
+static void ready_remove(web_conn_t *c)
+{
+    web_conn_t **pp = &ready_head, *prev = NULL;
+    while (*pp && *pp != c) {
+        prev = *pp;
+        pp = &(*pp)->next_ready;
     }
-    *bufp = 0;
-    return n;
+    if (!*pp)
+        return;
+    *pp = c->next_ready;
+    if (ready_tail == c)
+        ready_tail = prev;
+    c->queued = false;
+}
+
+/* Make sure buffer has room for extra more bytes beyond len */
+static bool buf_reserve(char **buf, size_t *cap, size_t len, size_t extra)
+{
+    if (len + extra <= *cap)
+        return true;
+    size_t ncap = *cap ? *cap : BUFSIZE;
+    while (ncap < len + extra)
+        ncap *= 2;
+    char *nbuf = realloc(*buf, ncap);
+    if (!nbuf)
+        return false;
+    *buf = nbuf;
+    *cap = ncap;
+    return true;
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static web_conn_t *conn_open(int fd)
+{
+    if (fd >= conns_cap) {
+        int cap = conns_cap ? conns_cap : 64;
+        while (cap <= fd)
+            cap *= 2;
+        web_conn_t **p = realloc(conns, cap * sizeof(web_conn_t *));
+        if (!p)
+            return NULL;
+        memset(p + conns_cap, 0, (cap - conns_cap) * sizeof(web_conn_t *));
+        conns = p;
+        conns_cap = cap;
+    }
+    web_conn_t *c = calloc(1, sizeof(web_conn_t));
+    if (!c)
+        return NULL;
+    c->fd = fd;
+    if (!mux_add(fd)) {
+        free(c);
+        return NULL;
+    }
+    conns[fd] = c;
+    return c;
+}
+
+static void conn_close(web_conn_t *c)
+{
+    if (c->queued)
+        ready_remove(c);
+    mux_del(c->fd);
+    close(c->fd);
+    conns[c->fd] = NULL;
+    if (pending.conn == c)
+        pending.conn = NULL;
+    free(c->batch);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void conn_append(web_conn_t *c, const char *data, size_t len)
+{
+    if (!buf_reserve(&c->out, &c->out_cap, c->out_len, len)) {
+        c->closing = true;
+        return;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+/* Send as much pending output as the socket takes. Return false if the
+ * connection has been closed.
+ */
+static bool conn_flush(web_conn_t *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!c->want_write) {
+                    c->want_write = true;
+                    mux_mod(c->fd, !c->eof, true);
+                }
+                return true;
+            }
+            conn_close(c);
+            return false;
+        }
+        c->out_off += n;
+    }
+
+    c->out_off = c->out_len = 0;
+    if (c->want_write) {
+        c->want_write = false;
+        mux_mod(c->fd, !c->eof, false);
+    }
+    if (c->closing) {
+        conn_close(c);
+        return false;
+    }
+    /* Pipelined requests may have been held back by OUT_HIGH, and a
+     * connection the peer closed is no longer polled for reading, so it
+     * must be served again to be closed.
+     */
+    if (c->throttled || c->eof) {
+        c->throttled = false;
+        ready_push(c);
+    }
+    return true;
 }
 
-void web_send(int out_fd, char *buf)
+/* Read everything available. Return false if the connection has been
+ * closed.
+ */
+static bool conn_read(web_conn_t *c)
 {
-    writen(out_fd, buf, strlen(buf));
+    /* Drop parsed requests before growing the buffer */
+    if (c->in_off) {
+        memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+        c->in_len -= c->in_off;
+        c->in_off = 0;
+    }
+
+    for (;;) {
+        if (!buf_reserve(&c->in, &c->in_cap, c->in_len, BUFSIZE)) {
+            conn_close(c);
+            return false;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += n;
+            continue;
+        }
+        if (n == 0) {
+            /* A closed socket stays readable, so stop polling for input */
+            c->eof = true;
+            mux_mod(c->fd, false, c->want_write);
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        conn_close(c);
+        return false;
+    }
+    ready_push(c);
+    return true;
+}
+
+static void web_accept(void)
+{
+    for (;;) {
+        struct sockaddr_in clientaddr;
+        socklen_t clientlen = sizeof(clientaddr);
+        int fd = accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            return; /* EAGAIN, or out of descriptors */
+        }
+
+        int optval = 1;
+        set_nonblocking(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &optval,
+                   sizeof(int));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (const void *) &optval,
+                   sizeof(int));
+#endif
+        if (!conn_open(fd))
+            close(fd);
+    }
 }
 
+/* ============================== HTTP ===================================== */
+
 int web_open(int port)
 {
     int listenfd, optval = 1;
@@ -137,12 +469,6 @@ int web_open(int port)
                    sizeof(int)) < 0)
         return -1;
 
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    if (setsockopt(listenfd, IPPROTO_TCP, TCP_CORK, (const void *) &optval,
-                   sizeof(int)) < 0)
-        return -1;
-
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     memset(&serveraddr, 0, sizeof(serveraddr));
@@ -156,20 +482,27 @@ int web_open(int port)
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
 
+    set_nonblocking(listenfd);
+    if (!mux_init() || !mux_add(listenfd))
+        return -1;
+    /* Fails for regular files, which are always readable anyway */
+    stdin_watched = mux_add(STDIN_FILENO);
+
     server_fd = listenfd;
 
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+/* Decode %xx escapes. Malformed escapes are copied as is */
+static void url_decode(const char *src, char *dest, int max)
 {
-    char *p = src;
-    char code[3] = {0};
+    const char *p = src;
     while (*p && --max) {
-        if (*p == '%') {
-            memcpy(code, ++p, 2);
+        if (p[0] == '%' && isxdigit((unsigned char) p[1]) &&
+            isxdigit((unsigned char) p[2])) {
+            char code[3] = {p[1], p[2], 0};
             *dest++ = (char) strtoul(code, NULL, 16);
-            p += 2;
+            p += 3;
         } else {
             *dest++ = *p++;
         }
@@ -177,94 +510,522 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
-{
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+/* Return the length of the line at p, without its terminator, or -1 if
+ * there is no complete line before end. *next is set past the terminator.
+ */
+static ssize_t next_line(char *p, char *end, char **next)
+{
+    char *nl = memchr(p, '\n', end - p);
+    if (!nl)
+        return -1;
+    *next = nl + 1;
+    if (nl > p && nl[-1] == '\r')
+        nl--;
+    return nl - p;
+}
+
+/* Parse one request from the connection buffer. Return the number of bytes
+ * it occupies, 0 if it is not complete yet, or -1 if it is malformed.
+ */
+static ssize_t parse_request(web_conn_t *c, http_request_t *req)
+{
+    char *start = c->in + c->in_off, *end = c->in + c->in_len;
+    char *p = start, *next;
+    char uri[MAXLINE], version[16] = "";
+    size_t content_length = 0;
+
+    ssize_t len = next_line(p, end, &next);
+    if (len < 0)
+        return (end - start) > MAX_HEADER ? -1 : 0;
+    if (len >= MAXLINE)
+        return -1;
+
+    char line[MAXLINE];
+    memcpy(line, p, len);
+    line[len] = '\0';
+    if (sscanf(line, "%15s %1023s %15s", req->method, uri, version) < 2)
+        return -1;
+    req->http11 = !strcmp(version, "HTTP/1.1");
+    req->keep_alive = req->http11;
+    req->json = false;
+
+    /* Headers up to the empty line */
+    for (p = next; (len = next_line(p, end, &next)) != 0; p = next) {
+        if (len < 0)
+            return (end - start) > MAX_HEADER ? -1 : 0;
+        if (!strncasecmp(p, "Connection:", 11)) {
+            char *v = p + 11;
+            while (*v == ' ' || *v == '\t')
+                v++;
+            if (!strncasecmp(v, "close", 5))
+                req->keep_alive = false;
+            else if (!strncasecmp(v, "keep-alive", 10))
+                req->keep_alive = true;
+        } else if (!strncasecmp(p, "Accept:", 7)) {
+            char value[MAXLINE];
+            size_t n = len - 7 < MAXLINE ? len - 7 : MAXLINE - 1;
+            memcpy(value, p + 7, n);
+            value[n] = '\0';
+            req->json = strstr(value, "application/json") != NULL;
+        } else if (!strncasecmp(p, "Content-Length:", 15)) {
+            content_length = strtoul(p + 15, NULL, 10);
+            if (content_length > MAX_BODY)
+                return -1;
         }
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
-            }
+
+    if ((size_t) (end - next) < content_length)
+        return 0;
+    req->body = next;
+    req->body_len = content_length;
+
+    /* Command is the path, with '/' separating arguments */
+    char *path = uri;
+    if (path[0] == '/')
+        path++;
+    char *query = strchr(path, '?');
+    if (query)
+        *query = '\0';
+    url_decode(path, req->cmd, MAXLINE);
+    for (char *q = req->cmd; *q; q++) {
+        if (*q == '/')
+            *q = ' ';
+    }
+
+    return next + content_length - start;
+}
+
+static void send_status(web_conn_t *c, const char *status, bool keep_alive)
+{
+    char header[128];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %s\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: 0\r\n"
+                       "%s\r\n",
+                       status, keep_alive ? "" : "Connection: close\r\n");
+    conn_append(c, header, len);
+    if (!keep_alive)
+        c->closing = true;
+}
+
+/* Queue a response made of cnt pieces. If nothing else is waiting to be
+ * sent, write it with a single sendmsg() and buffer only what is left.
+ * Like send() elsewhere, it takes MSG_NOSIGNAL, so that a peer that reset
+ * the connection does not raise SIGPIPE.
+ */
+static void conn_writev(web_conn_t *c, struct iovec *iov, int cnt)
+{
+    /* Pipelined responses are batched in the output buffer instead */
+    if (c->out_off == c->out_len && c->in_off == c->in_len) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+        ssize_t n;
+        do {
+            n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            c->closing = true;
+            return;
+        }
+        for (int i = 0; n > 0 && i < cnt; i++) {
+            size_t skip = iov[i].iov_len;
+            if ((size_t) n < skip)
+                skip = n;
+            iov[i].iov_base = (char *) iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            n -= skip;
         }
     }
-    url_decode(filename, req->filename, MAXLINE);
+    for (int i = 0; i < cnt; i++)
+        conn_append(c, iov[i].iov_base, iov[i].iov_len);
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+/* Append data to the body of a batch response */
+static void batch_append(web_conn_t *c, const char *data, size_t len)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    if (!len)
+        return;
+    if (c->batch_chunked) {
+        char size[20];
+        int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+        conn_append(c, size, n);
+        conn_append(c, data, len);
+        conn_append(c, "\r\n", 2);
+    } else {
+        conn_append(c, data, len);
+    }
+}
+
+/* Start capturing the output of cmd for connection c */
+static size_t capture_command(web_conn_t *c, const char *cmd)
+{
+    size_t len = strlen(cmd);
+    memcpy(pending.cmd, cmd, len + 1);
+    pending.conn = c;
+    pending.out_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pending.start);
+    return len;
+}
+
+/* Hand a command to the console, capturing its output until web_finish() */
+static int start_command(web_conn_t *c, const char *cmd, char *buf)
+{
+    size_t len = capture_command(c, cmd);
+    memcpy(buf, cmd, len + 1);
+    return len;
+}
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+/* Return the next command of the batch, or NULL once it is exhausted */
+static char *batch_line(web_conn_t *c)
+{
+    while (c->batch_pos < c->batch_len) {
+        char *line = c->batch + c->batch_pos;
+        char *next;
+        ssize_t len = next_line(line, c->batch + c->batch_len, &next);
+        if (len < 0) { /* last line without newline */
+            len = c->batch_len - c->batch_pos;
+            next = line + len;
+        }
+        c->batch_pos = next - c->batch;
+        if (len == 0)
+            continue;
+        if (len >= MAXLINE) {
+            static const char msg[] = "ERR\t(command too long)\n";
+            batch_append(c, msg, sizeof(msg) - 1);
+            continue;
+        }
+        line[len] = '\0';
+        return line;
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+    return NULL;
+}
+
+/* Finish the response to a batch, and serve what follows it */
+static void batch_end(web_conn_t *c)
+{
+    if (c->batch_chunked)
+        conn_append(c, "0\r\n\r\n", 5);
+    if (!c->batch_keep_alive)
+        c->closing = true;
+    free(c->batch);
+    c->batch = NULL;
 
-    return ret;
+    if (c->in_len > c->in_off && !c->closing)
+        ready_push(c);
+    else
+        conn_flush(c);
 }
 
-int web_eventmux(char *buf)
+/* Copy the next command of the batch into buf and return its length, or
+ * finish the response and return 0 once the batch is exhausted.
+ */
+static int batch_next(web_conn_t *c, char *buf)
 {
-    fd_set listenset;
+    char *line = batch_line(c);
+    if (line)
+        return start_command(c, line, buf);
+    batch_end(c);
+    return 0;
+}
 
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+/* Start running the newline-separated commands in a POST body */
+static int batch_start(web_conn_t *c, http_request_t *req, char *buf)
+{
+    c->batch = malloc(req->body_len + 1);
+    if (!c->batch) {
+        send_status(c, "500 Internal Server Error", false);
+        conn_flush(c);
+        return 0;
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
-        return -1;
+    memcpy(c->batch, req->body, req->body_len);
+    c->batch_pos = 0;
+    c->batch_len = req->body_len;
+    /* HTTP/1.0 clients get a body delimited by closing the connection */
+    c->batch_chunked = req->http11;
+    c->batch_keep_alive = req->http11 && req->keep_alive;
+    c->json = req->json;
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        int web_connfd =
-            accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
+    char header[160];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: %s\r\n"
+                       "%s\r\n",
+                       c->json ? "application/x-ndjson" : "text/plain",
+                       c->batch_chunked ? "Transfer-Encoding: chunked\r\n"
+                                        : "Connection: close\r\n");
+    conn_append(c, header, len);
+
+    return batch_next(c, buf);
+}
+
+void web_append(const char *data, size_t len)
+{
+    if (!pending.conn)
+        return;
+    if (!buf_reserve(&pending.out, &pending.out_cap, pending.out_len, len))
+        return;
+    memcpy(pending.out + pending.out_len, data, len);
+    pending.out_len += len;
+}
 
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-        strncpy(buf, p, strlen(p) + 1);
-        free(p);
-        close(web_connfd);
-        return strlen(buf);
+void web_set_size_func(web_size_func_t func)
+{
+    size_func = func;
+}
+
+void web_set_interpret_func(web_interpret_func_t interpret,
+                            web_done_func_t done)
+{
+    interpret_func = interpret;
+    done_func = done;
+}
+
+/* Append s to the scratch buffer as the contents of a JSON string */
+static void json_escape(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char esc[8];
+        unsigned char ch = s[i];
+        size_t n = 1;
+        esc[0] = ch;
+        if (ch == '"' || ch == '\\') {
+            esc[0] = '\\';
+            esc[1] = ch;
+            n = 2;
+        } else if (ch == '\n') {
+            memcpy(esc, "\\n", n = 2);
+        } else if (ch == '\t') {
+            memcpy(esc, "\\t", n = 2);
+        } else if (ch < 0x20) {
+            n = snprintf(esc, sizeof(esc), "\\u%04x", ch);
+        }
+        if (!buf_reserve(&scratch, &scratch_cap, scratch_len, n))
+            return;
+        memcpy(scratch + scratch_len, esc, n);
+        scratch_len += n;
     }
+}
 
-    FD_CLR(STDIN_FILENO, &listenset);
-    return 0;
+static void scratch_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !buf_reserve(&scratch, &scratch_cap, scratch_len, n + 1))
+        return;
+    va_start(ap, fmt);
+    vsnprintf(scratch + scratch_len, n + 1, fmt, ap);
+    va_end(ap);
+    scratch_len += n;
+}
+
+/* Describe the finished command as a JSON object in the scratch buffer */
+static void json_result(bool ok, bool with_cmd)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long latency = (now.tv_sec - pending.start.tv_sec) * 1000000L +
+                   (now.tv_nsec - pending.start.tv_nsec) / 1000;
+
+    scratch_printf("{");
+    if (with_cmd) {
+        scratch_printf("\"cmd\":\"");
+        json_escape(pending.cmd, strlen(pending.cmd));
+        scratch_printf("\",");
+    }
+    scratch_printf("\"status\":\"%s\",\"latency_us\":%ld,", ok ? "ok" : "error",
+                   latency);
+    if (size_func)
+        scratch_printf("\"size\":%d,", size_func());
+    scratch_printf("\"output\":\"");
+    json_escape(pending.out, pending.out_len);
+    scratch_printf("\"}\n");
+}
+
+/* Append the result of the command just run to the batch response */
+static void batch_result(web_conn_t *c, bool ok)
+{
+    pending.conn = NULL;
+    scratch_len = 0;
+    if (c->json) {
+        json_result(ok, true);
+    } else {
+        scratch_printf("%s\t%s\n", ok ? "OK" : "ERR", pending.cmd);
+        if (buf_reserve(&scratch, &scratch_cap, scratch_len,
+                        pending.out_len)) {
+            memcpy(scratch + scratch_len, pending.out, pending.out_len);
+            scratch_len += pending.out_len;
+        }
+    }
+    batch_append(c, scratch, scratch_len);
+}
+
+/* Run the rest of a batch without going back to the console loop, until
+ * it is done, the client falls behind or the console is to quit
+ */
+static void batch_run(web_conn_t *c)
+{
+    while (1) {
+        /* Stream results out as they accumulate */
+        if (c->out_len - c->out_off >= BUFSIZE && !conn_flush(c))
+            return;
+        if (!interpret_func || c->out_len - c->out_off > OUT_HIGH) {
+            /* Resumed by serve_next() */
+            ready_push(c);
+            return;
+        }
+        if (done_func && done_func()) {
+            batch_end(c);
+            return;
+        }
+
+        char *line = batch_line(c);
+        if (!line) {
+            batch_end(c);
+            return;
+        }
+        capture_command(c, line);
+        batch_result(c, interpret_func(line));
+    }
+}
+
+void web_finish(bool ok)
+{
+    web_conn_t *c = pending.conn;
+    if (!c)
+        return;
+
+    if (c->batch) {
+        batch_result(c, ok);
+        batch_run(c);
+        return;
+    }
+
+    pending.conn = NULL;
+    scratch_len = 0;
+
+    struct iovec iov[2];
+    if (c->json) {
+        json_result(ok, false);
+        iov[1].iov_base = scratch;
+        iov[1].iov_len = scratch_len;
+    } else {
+        iov[1].iov_base = pending.out;
+        iov[1].iov_len = pending.out_len;
+    }
+
+    char header[160];
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zu\r\n"
+                              "%s\r\n",
+                              c->json ? "application/json" : "text/plain",
+                              iov[1].iov_len,
+                              c->keep_alive ? "" : "Connection: close\r\n");
+    conn_writev(c, iov, 2);
+
+    if (!c->keep_alive)
+        c->closing = true;
+    if (c->in_len > c->in_off && !c->closing)
+        ready_push(c);
+    else
+        conn_flush(c);
+}
+
+/* Serve the next request buffered on connection c. Return the length of the
+ * command copied into buf, or 0 if there is no command to run.
+ */
+static int serve_next(web_conn_t *c, char *buf)
+{
+    if (c->closing)
+        return 0;
+    if (c->out_len - c->out_off > OUT_HIGH) {
+        c->throttled = true;
+        conn_flush(c);
+        return 0;
+    }
+    if (c->batch)
+        return batch_next(c, buf);
+
+    http_request_t req;
+    ssize_t n = parse_request(c, &req);
+    if (n < 0) {
+        send_status(c, "400 Bad Request", false);
+        conn_flush(c);
+        return 0;
+    }
+    if (n == 0) {
+        if (c->eof && c->out_off == c->out_len)
+            conn_close(c);
+        else
+            conn_flush(c);
+        return 0;
+    }
+
+    c->in_off += n;
+    if (!strcmp(req.method, "POST"))
+        return batch_start(c, &req, buf);
+
+    if (!req.cmd[0]) {
+        send_status(c, "200 OK", req.keep_alive);
+        if (c->in_len > c->in_off && !c->closing)
+            ready_push(c);
+        else
+            conn_flush(c);
+        return 0;
+    }
+
+    /* Reply once the console has run the command */
+    c->keep_alive = req.keep_alive;
+    c->json = req.json;
+    return start_command(c, req.cmd, buf);
+}
+
+int web_eventmux(char *buf)
+{
+    mux_event_t events[MAX_EVENTS];
+
+    /* The console did not report back on the last command */
+    if (pending.conn)
+        web_finish(true);
+
+    for (;;) {
+        web_conn_t *c;
+        while ((c = ready_pop())) {
+            int len = serve_next(c, buf);
+            if (len > 0)
+                return len;
+        }
+
+        /* Only poll the sockets if stdin can not be waited for */
+        int n = mux_wait(events, MAX_EVENTS, stdin_watched ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        bool stdin_ready = !stdin_watched;
+        for (int i = 0; i < n; i++) {
+            mux_event_t *e = &events[i];
+            int fd = MUX_FD(e);
+            if (fd == STDIN_FILENO) {
+                stdin_ready = true;
+            } else if (fd == server_fd) {
+                web_accept();
+            } else if (fd < conns_cap && conns[fd]) {
+                c = conns[fd];
+                if (MUX_WRITABLE(e) && c->want_write && !conn_flush(c))
+                    continue;
+                if (MUX_READABLE(e))
+                    conn_read(c);
+            }
+        }
+
+        if (stdin_ready && !ready_head)
+            return 0;
+    }
 }
@@ -2,13 +2,33 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 int web_open(int port);
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+int web_eventmux(char *buf);
 
-void web_send(int out_fd, char *buffer);
+/* Send the reply for the command last returned by web_eventmux(), with
+ * the output captured since then. Does nothing if the command did not come
+ * from the web server.
+ */
+void web_finish(bool ok);
 
-int web_eventmux(char *buf);
+/* Capture output of the command being run for the web client */
+void web_append(const char *data, size_t len);
+
+/* Function returning the queue size reported in JSON replies */
+typedef int (*web_size_func_t)(void);
+void web_set_size_func(web_size_func_t func);
+
+/* Functions running a command line and telling whether the console is to
+ * quit. With them, the commands of a POST batch after the first are run
+ * straight from web_finish() instead of one per console loop.
+ */
+typedef bool (*web_interpret_func_t)(char *cmdline);
+typedef bool (*web_done_func_t)(void);
+void web_set_interpret_func(web_interpret_func_t interpret,
+                            web_done_func_t done);
 
 #endif
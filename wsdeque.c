@@ -0,0 +1,302 @@
+/* Work-stealing deque, and a benchmark of it against a locked list */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "list.h"
+#include "wsdeque.h"
+
+/* The owner writes bottom and thieves write top, so they are kept on cache
+ * lines of their own.
+ */
+#define CACHE_LINE 64
+
+/* Items the deque holds before it first grows, a power of two */
+#define WSD_MIN_SIZE 64
+
+/* Circular array of items. When it fills up, the owner copies the items to
+ * one twice as large. Thieves may still be reading the old one, so it is
+ * only freed with the deque.
+ */
+typedef struct wsd_array {
+    int64_t size;
+    struct wsd_array *prev; /* Arrays outgrown */
+    _Atomic(void *) item[];
+} wsd_array_t;
+
+struct wsdeque {
+    _Alignas(CACHE_LINE) _Atomic int64_t top;
+    _Alignas(CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic(wsd_array_t *) array;
+};
+
+static wsd_array_t *new_array(int64_t size)
+{
+    wsd_array_t *a = malloc(sizeof(wsd_array_t) + size * sizeof(void *));
+    if (!a)
+        return NULL;
+    a->size = size;
+    a->prev = NULL;
+    return a;
+}
+
+static inline void *array_get(wsd_array_t *a, int64_t i)
+{
+    return atomic_load_explicit(&a->item[i & (a->size - 1)],
+                                memory_order_relaxed);
+}
+
+static inline void array_put(wsd_array_t *a, int64_t i, void *x)
+{
+    atomic_store_explicit(&a->item[i & (a->size - 1)], x,
+                          memory_order_relaxed);
+}
+
+wsdeque_t *wsd_new(void)
+{
+    wsdeque_t *d = aligned_alloc(CACHE_LINE, sizeof(wsdeque_t));
+    if (!d)
+        return NULL;
+    wsd_array_t *a = new_array(WSD_MIN_SIZE);
+    if (!a) {
+        free(d);
+        return NULL;
+    }
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, a);
+    return d;
+}
+
+void wsd_free(wsdeque_t *d)
+{
+    if (!d)
+        return;
+    wsd_array_t *a = atomic_load(&d->array);
+    while (a) {
+        wsd_array_t *prev = a->prev;
+        free(a);
+        a = prev;
+    }
+    free(d);
+}
+
+/* Copy the items from top to bottom into an array twice as large */
+static wsd_array_t *grow(wsdeque_t *d, wsd_array_t *a, int64_t t, int64_t b)
+{
+    wsd_array_t *bigger = new_array(2 * a->size);
+    if (!bigger)
+        return NULL;
+    for (int64_t i = t; i < b; i++)
+        array_put(bigger, i, array_get(a, i));
+    bigger->prev = a;
+    atomic_store_explicit(&d->array, bigger, memory_order_release);
+    return bigger;
+}
+
+bool wsd_insert_head(wsdeque_t *d, void *item)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    wsd_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (b - t > a->size - 1 && !(a = grow(d, a, t, b)))
+        return false;
+    array_put(a, b, item);
+    /* The item must be in place before a thief can see it */
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+void *wsd_remove_head(wsdeque_t *d)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    wsd_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    /* Thieves must see the item claimed before top is read */
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        /* Empty */
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    void *x = array_get(a, b);
+    if (t == b) {
+        /* The last item, which a thief may be taking too */
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            x = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return x;
+}
+
+void *wsd_remove_tail(wsdeque_t *d)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+
+    wsd_array_t *a = atomic_load_explicit(&d->array, memory_order_acquire);
+    void *x = array_get(a, t);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return x;
+}
+
+/* Benchmark
+ *
+ * Tasks are preallocated, so that both kinds of queue only move pointers:
+ * the deque holds pointers to the tasks, and the list links them.
+ */
+
+typedef struct {
+    struct list_head list;
+    atomic_int taken;
+} task_t;
+
+static struct {
+    bool locked;
+    wsdeque_t *deque;
+    struct list_head head; /* Locked list */
+    pthread_mutex_t lock;
+    atomic_bool done; /* Owner took the last task it could */
+    atomic_long stolen;
+} bench;
+
+static void push(task_t *task)
+{
+    if (!bench.locked) {
+        wsd_insert_head(bench.deque, task);
+        return;
+    }
+    pthread_mutex_lock(&bench.lock);
+    list_add(&task->list, &bench.head);
+    pthread_mutex_unlock(&bench.lock);
+}
+
+static task_t *pop(void)
+{
+    if (!bench.locked)
+        return wsd_remove_head(bench.deque);
+    task_t *task = NULL;
+    pthread_mutex_lock(&bench.lock);
+    if (!list_empty(&bench.head)) {
+        task = list_first_entry(&bench.head, task_t, list);
+        list_del(&task->list);
+    }
+    pthread_mutex_unlock(&bench.lock);
+    return task;
+}
+
+static task_t *steal(void)
+{
+    if (!bench.locked)
+        return wsd_remove_tail(bench.deque);
+    task_t *task = NULL;
+    pthread_mutex_lock(&bench.lock);
+    if (!list_empty(&bench.head)) {
+        task = list_last_entry(&bench.head, task_t, list);
+        list_del(&task->list);
+    }
+    pthread_mutex_unlock(&bench.lock);
+    return task;
+}
+
+static void *thief(void *arg)
+{
+    long stolen = 0;
+    while (1) {
+        /* The owner is done before the last steal is tried */
+        bool done = atomic_load(&bench.done);
+        task_t *task = steal();
+        if (task) {
+            atomic_fetch_add_explicit(&task->taken, 1, memory_order_relaxed);
+            stolen++;
+        } else if (done) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    atomic_fetch_add(&bench.stolen, stolen);
+    return NULL;
+}
+
+bool wsd_bench(bool locked, wsd_bench_t *b)
+{
+    pthread_t *threads = malloc(b->thieves * sizeof(pthread_t));
+    task_t *tasks = malloc(b->tasks * sizeof(task_t));
+    bench.deque = locked ? NULL : wsd_new();
+    if (!threads || !tasks || (!locked && !bench.deque)) {
+        free(threads);
+        free(tasks);
+        wsd_free(bench.deque);
+        return false;
+    }
+    for (long i = 0; i < b->tasks; i++)
+        atomic_init(&tasks[i].taken, 0);
+    bench.locked = locked;
+    INIT_LIST_HEAD(&bench.head);
+    pthread_mutex_init(&bench.lock, NULL);
+    atomic_store(&bench.done, false);
+    atomic_store(&bench.stolen, 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Leave signals such as SIGALRM to the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int started = 0;
+    for (; started < b->thieves; started++) {
+        if (pthread_create(&threads[started], NULL, thief, NULL) != 0)
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* The owner runs on this thread, so the deque keeps growing */
+    for (long i = 0; i < b->tasks; i++) {
+        push(&tasks[i]);
+        if (i & 1) {
+            task_t *task = pop();
+            if (task)
+                atomic_fetch_add_explicit(&task->taken, 1,
+                                          memory_order_relaxed);
+        }
+    }
+    for (task_t *task; (task = pop());)
+        atomic_fetch_add_explicit(&task->taken, 1, memory_order_relaxed);
+    atomic_store(&bench.done, true);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    b->seconds = (end.tv_sec - start.tv_sec) +
+                 (end.tv_nsec - start.tv_nsec) / 1e9;
+    b->stolen = atomic_load(&bench.stolen);
+    b->errors = 0;
+    for (long i = 0; i < b->tasks; i++)
+        b->errors += atomic_load(&tasks[i].taken) != 1;
+
+    pthread_mutex_destroy(&bench.lock);
+    wsd_free(bench.deque);
+    bench.deque = NULL;
+    free(tasks);
+    free(threads);
+    return started == b->thieves;
+}
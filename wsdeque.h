@@ -0,0 +1,55 @@
+#ifndef LAB0_WSDEQUE_H
+#define LAB0_WSDEQUE_H
+
+#include <stdbool.h>
+
+/* Work-stealing deque of Chase and Lev, "Dynamic Circular Work-Stealing
+ * Deque" (SPAA 2005), with the memory orderings of Le et al., "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ *
+ * One thread owns the deque and uses its head as a stack, as with
+ * q_insert_head() and q_remove_head(). Any other thread may steal from the
+ * tail, as with q_remove_tail(). The owner does not need a read-modify-write
+ * instruction except to take the last item, when it could race a thief.
+ * Items are pointers and may not be NULL.
+ */
+
+typedef struct wsdeque wsdeque_t;
+
+/* Create an empty deque. Return NULL if allocation failed */
+wsdeque_t *wsd_new(void);
+
+/* Free a deque, but not the items left in it. No other thread may be using
+ * the deque.
+ */
+void wsd_free(wsdeque_t *d);
+
+/* Owner only: push item at the head. Return false if allocation failed */
+bool wsd_insert_head(wsdeque_t *d, void *item);
+
+/* Owner only: pop the item at the head. Return NULL if the deque was empty */
+void *wsd_remove_head(wsdeque_t *d);
+
+/* Any thread: steal the item at the tail. Return NULL if the deque was empty
+ * or another thread took the item first.
+ */
+void *wsd_remove_tail(wsdeque_t *d);
+
+/* Benchmark: the owner pushes tasks and pops every other one while thieves
+ * steal, until all are taken. Every task is checked to be taken once.
+ */
+typedef struct {
+    int thieves;
+    long tasks;
+    double seconds; /* Elapsed time */
+    long stolen;    /* Tasks taken by thieves */
+    long errors;    /* Tasks not taken exactly once */
+} wsd_bench_t;
+
+/* Run the benchmark on a deque, or on a list_head queue under a mutex if
+ * locked, with the counts set in b, and fill in the rest. Return false if
+ * the threads could not be started.
+ */
+bool wsd_bench(bool locked, wsd_bench_t *b);
+
+#endif /* LAB0_WSDEQUE_H */